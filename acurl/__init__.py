@@ -1,8 +1,13 @@
 import _acurl
+import itertools
+import mmap
+import os
 import threading
 import asyncio
 import ujson
 import time
+import zlib
+from collections.abc import Mapping
 from urllib.parse import urlparse
 
 
@@ -179,6 +184,36 @@ class Request:
         return self._cert
 
 
+# Field names are ASCII, so like the keys get_header_map makes, names are
+# only lowercased in the ASCII range
+_ASCII_LOWER = str.maketrans('ABCDEFGHIJKLMNOPQRSTUVWXYZ', 'abcdefghijklmnopqrstuvwxyz')
+
+
+class Headers(Mapping):
+    """Response header fields, looked up case-insensitively.  Iterating gives
+    the names as the server sent them.  If a name is repeated the last value
+    wins; headers_tuple has them all."""
+    __slots__ = ('_map',)
+
+    def __init__(self, header_map):
+        self._map = header_map
+
+    def __getitem__(self, name):
+        return self._map[name.translate(_ASCII_LOWER)][1]
+
+    def __contains__(self, name):
+        return isinstance(name, str) and name.translate(_ASCII_LOWER) in self._map
+
+    def __iter__(self):
+        return (name for name, value in self._map.values())
+
+    def __len__(self):
+        return len(self._map)
+
+    def __repr__(self):
+        return 'Headers({!r})'.format(dict(self._map.values()))
+
+
 class Response:
     __slots__ = '_req _resp _start_time _redirect_url _prev _body _text _header _headers_tuple _headers _encoding _json'.split()
 
@@ -268,9 +303,36 @@ class Response:
     @property
     def body(self):
         if not hasattr(self, '_body'):
-            self._body = b''.join(self._resp.get_body())
+            self._body = self._resp.get_body()
         return self._body
 
+    async def iter_body(self):
+        """The body of a response from Session.stream(), in pieces as it
+        arrives"""
+        loop = asyncio.get_event_loop()
+        while True:
+            waiter = loop.create_future()
+            data = self._resp.read_stream(waiter)
+            if data is None:
+                error = self._resp.get_stream_error()
+                if error is not None:
+                    raise RequestError(error)
+                return
+            if data:
+                yield data
+            else:
+                await waiter
+
+    @property
+    def body_checksum(self):
+        """A 64 bit checksum of the body with body_mode 'count', otherwise None"""
+        return self._resp.get_body_checksum()
+
+    @property
+    def body_view(self):
+        """A read-only memoryview of the body, which doesn't copy it"""
+        return memoryview(self._resp)
+
     @property
     def encoding(self):
         if not hasattr(self, '_encoding'):
@@ -292,33 +354,87 @@ class Response:
 
     def json(self):
         if not hasattr(self, '_json'):
-            self._json = ujson.loads(self.text)
+            # JSON is UTF-8, so unless the server says otherwise it is decoded
+            # in C straight from the body, with no bytes or str in between
+            if ('charset=' not in self.headers.get('Content-Type', '') or
+                    self.encoding.lower().replace('-', '') == 'utf8'):
+                self._json = self._resp.get_json()
+            else:
+                self._json = ujson.loads(self.text)
         return self._json
 
     @property
     def headers(self):
         if not hasattr(self, '_headers'):
-            self._headers = dict(self.headers_tuple)
+            self._headers = Headers(self._resp.get_header_map())
         return self._headers
 
     @property
     def headers_tuple(self):
         if not hasattr(self, '_headers_tuple'):
-            self._headers_tuple = tuple(tuple(l.split(': ', 1)) for l in self.header.split('\r\n')[1:-2])
+            self._headers_tuple = self._resp.get_headers()
         return self._headers_tuple
 
     @property
     def header(self):
         if not hasattr(self, '_header'):
-            self._header = b''.join(self._resp.get_header()).decode('ascii')
+            self._header = self._resp.get_header().decode('latin1')
         return self._header
 
 
+def _map_file(path):
+    """The contents of a file to send as a request body, mapped rather than
+    read in"""
+    with open(path, 'rb') as f:
+        size = os.fstat(f.fileno()).st_size
+        if size == 0:
+            return b''
+        mapped = mmap.mmap(f.fileno(), size, access=mmap.ACCESS_READ)
+    if hasattr(mapped, 'madvise'):
+        # Doubles the kernel's readahead on the file
+        mapped.madvise(mmap.MADV_SEQUENTIAL)
+    return mapped
+
+
+class PreparedRequest:
+    """A request made by Session.prepare(), to be sent with send().  Unlike
+    Session.request(), redirects aren't followed."""
+    __slots__ = '_session _prepared _method _url _header_list _auth _cert'.split()
+
+    def __init__(self, session, prepared, method, url, header_list, auth, cert):
+        self._session = session
+        self._prepared = prepared
+        self._method = method
+        self._url = url
+        self._header_list = header_list
+        self._auth = auth
+        self._cert = cert
+
+    async def send(self, url_suffix=None, data=None):
+        """Send the request, to the URL it was prepared with plus url_suffix
+        if given, with data as its body, as for Session.request()"""
+        start_time = time.time()
+        future = self._session._loop.create_future()
+        self._prepared.send(future, url_suffix, data)
+        url = self._url if url_suffix is None else self._url + url_suffix
+        request = Request(self._method, url, self._header_list, None, self._auth, data, self._cert)
+        response = Response(request, await future, start_time)
+        if self._session._response_callback:
+            await self._session._response_callback(response)
+        return response
+
+
 class Session:
-    def __init__(self, ae_loop, loop):
+    def __init__(self, ae_loop, loop, body_mode=None, max_handles=None):
+        """body_mode is the default for this session's requests, see request().
+        Up to max_handles curl handles are kept between requests for reuse."""
         self._loop = loop
-        self._session = _acurl.Session(ae_loop)
+        if max_handles is None:
+            self._session = _acurl.Session(ae_loop)
+        else:
+            self._session = _acurl.Session(ae_loop, max_handles=max_handles)
         self._response_callback = None
+        self._body_mode = body_mode
 
     async def get(self, url, **kwargs):
         return await self.request('GET', url, **kwargs)
@@ -338,7 +454,41 @@ class Session:
     async def options(self, url, **kwargs):
         return await self.request('OPTIONS', url, **kwargs)
 
-    async def request(self, method, url, headers=None, headers_list=None, cookies=None, cookie_list=None, auth=None, data=None, json=None, cert=None, allow_redirects=True, max_redirects=5):
+    async def stream(self, method, url, **kwargs):
+        """Like request(), but returns as soon as the headers are in.  Read
+        the body with `async for chunk in response.iter_body()`.  Only a
+        bounded amount of it is buffered: the transfer is paused until the
+        reader catches up."""
+        return await self.request(method, url, body_mode='stream', **kwargs)
+
+    async def request(self, method, url, headers=None, headers_list=None, cookies=None, cookie_list=None, auth=None, data=None, json=None, cert=None, allow_redirects=True, max_redirects=5, body_mode=None, upload_file=None, download_to=None, download_direct=False):
+        """data is a str, sent UTF-8 encoded, or any bytes-like object
+        (bytes, bytearray, memoryview, mmap, ...), which is sent as it is,
+        without being copied, so it shouldn't be changed until the request
+        is done.  upload_file is the path of a file to send instead, which
+        is mapped into memory rather than read.
+
+        download_to is the path of a file to write the body to, straight
+        from the event loop thread.  With download_direct it is opened with
+        O_DIRECT, if the filesystem supports that, to keep large downloads
+        out of the page cache.
+
+        body_mode is 'store' (the default) to keep the body, or, for load
+        generation, 'discard' to drop it as it arrives or 'count' to drop it
+        but keep Response.body_checksum.  Either way the size is still in
+        Response.download_size.  See also stream()."""
+        if download_to is not None:
+            if body_mode is not None:
+                raise ValueError('use only one or none of body_mode or download_to')
+            download_to = os.fspath(download_to)
+        elif download_direct:
+            raise ValueError('download_direct needs download_to')
+        elif body_mode is None:
+            body_mode = self._body_mode
+        if upload_file is not None:
+            if data is not None or json is not None:
+                raise ValueError('use only one or none of data, json or upload_file')
+            data = _map_file(upload_file)
         if json is not None:
             if data is not None:
                 raise ValueError('use only one or none of data or json')
@@ -364,18 +514,69 @@ class Session:
             for k, v in cookies.items():
                 cookie_list.append(session_cookie_for_url(url, k, v))
 
-        return await self._request(method, url, tuple(headers_list) if headers_list else None, tuple(cookie_list) if cookie_list else None, auth, data, cert, allow_redirects, max_redirects)
+        return await self._request(method, url, tuple(headers_list) if headers_list else None, tuple(cookie_list) if cookie_list else None, auth, data, cert, allow_redirects, max_redirects, body_mode, download_to, download_direct)
+
+    async def request_many(self, requests, headers=None, headers_list=None, auth=None, cert=None, body_mode=None):
+        """Send many requests at once, for a fan-out.  requests is an iterable
+        of (method, url) or (method, url, data) tuples, and headers, auth,
+        cert and body_mode apply to all of them.  They are checked and handed
+        to the event loop thread in one go, so either all are sent or none
+        are.  Returns their Responses in the same order; if any failed, the
+        first failure is raised once they are all done, and the response
+        callback has been given the rest.  Redirects aren't followed."""
+        if body_mode is None:
+            body_mode = self._body_mode
+        if headers:
+            headers_list = list(headers_list or ())
+            headers_list.extend('%s: %s' % i for i in headers.items())
+        header_tuple = tuple(headers_list) if headers_list else None
+        start_time = time.time()
+        create_future = self._loop.create_future
+        specs = []
+        for request in requests:
+            method, url = request[0], request[1]
+            data = request[2] if len(request) > 2 else None
+            specs.append((create_future(), method, url, header_tuple, auth, None, data, cert))
+        self._session.request_many(specs, body_mode=body_mode)
+        results = await asyncio.gather(*[spec[0] for spec in specs], return_exceptions=True)
+        responses = []
+        failure = None
+        for spec, result in zip(specs, results):
+            if isinstance(result, BaseException):
+                failure = failure or result
+                continue
+            request = Request(spec[1], spec[2], header_tuple, None, auth, spec[6], cert)
+            response = Response(request, result, start_time)
+            if self._response_callback:
+                await self._response_callback(response)
+            responses.append(response)
+        if failure is not None:
+            raise failure
+        return responses
+
+    def prepare(self, method, url, headers=None, headers_list=None, auth=None, cert=None, body_mode=None):
+        """A PreparedRequest, for sending the same request many times.  The
+        headers, auth and cert are checked and converted for curl once, here,
+        rather than on every request."""
+        if body_mode is None:
+            body_mode = self._body_mode
+        if headers:
+            headers_list = list(headers_list or ())
+            headers_list.extend('%s: %s' % i for i in headers.items())
+        header_tuple = tuple(headers_list) if headers_list else None
+        prepared = self._session.prepare(method, url, header_tuple, auth, cert, body_mode)
+        return PreparedRequest(self, prepared, method, url, header_tuple, auth, cert)
 
     # TODO: make it a property
     def set_response_callback(self, callback):
         self._response_callback = callback
 
-    async def _request(self, method, url, header_tuple, cookie_tuple, auth, data, cert, allow_redirects, remaining_redirects):
+    async def _request(self, method, url, header_tuple, cookie_tuple, auth, data, cert, allow_redirects, remaining_redirects, body_mode, download_to, download_direct):
         start_time = time.time()
         request = Request(method, url, header_tuple, cookie_tuple, auth, data, cert)
 
         future = self._loop.create_future()
-        self._session.request(future, method, url, headers=header_tuple, cookies=tuple(c.format() for c in cookie_tuple) if cookie_tuple else None, auth=auth, data=data, dummy=False, cert=cert)
+        self._session.request(future, method, url, headers=header_tuple, cookies=tuple(c.format() for c in cookie_tuple) if cookie_tuple else None, auth=auth, data=data, dummy=False, cert=cert, body_mode=body_mode, download_to=download_to, direct=download_direct)
         response = Response(request, await future, start_time)
 
         if self._response_callback:
@@ -384,9 +585,9 @@ class Session:
             if remaining_redirects == 0:
                 raise RequestError('Max Redirects')
             elif response.status_code in {301, 302, 303}:
-                redir_response = await self._request('GET', response.redirect_url, header_tuple, None, auth, None, cert, allow_redirects, remaining_redirects - 1)
+                redir_response = await self._request('GET', response.redirect_url, header_tuple, None, auth, None, cert, allow_redirects, remaining_redirects - 1, body_mode, download_to, download_direct)
             else:
-                redir_response = await self._request(method, response.redirect_url, header_tuple, None, auth, data, cert, allow_redirects, remaining_redirects - 1)
+                redir_response = await self._request(method, response.redirect_url, header_tuple, None, auth, data, cert, allow_redirects, remaining_redirects - 1, body_mode, download_to, download_direct)
             redir_response._prev = response
             return redir_response
         return response
@@ -410,22 +611,50 @@ class Session:
         await self._dummy_request(tuple(c.format() for c in cookie_list))
 
 
+def _ae_loop_kwargs(**kwargs):
+    return {k: v for k, v in kwargs.items() if v is not None}
+
+
+def _resolve_completed(ae_loop):
+    ae_loop.resolve_completed(RequestError)
+
+
 class EventLoop:
-    def __init__(self, loop=None, same_thread=False):
+    def __init__(self, loop=None, same_thread=False, max_admission_batch=None, backend=None,
+                 cpus=None, sched_fifo=None, nice=None, busy_poll_us=None):
+        """cpus, sched_fifo (a SCHED_FIFO priority) and nice apply to the event
+        loop thread; they are ignored with same_thread.  'io_uring' as the
+        backend falls back to epoll on kernels without it, see
+        get_stats()['backend'].
+
+        With busy_poll_us the loop thread keeps polling, burning a core, for
+        that long after each event before it blocks again.  This takes the
+        wake-up latency out of benchmarks against fast local services."""
         self._loop = loop if loop is not None else asyncio.get_event_loop()
-        self._ae_loop = _acurl.EventLoop()
         self._running = False
+        self._ae_loop = _acurl.EventLoop(**_ae_loop_kwargs(
+            max_admission_batch=max_admission_batch, backend=backend,
+            cpus=cpus, sched_fifo=sched_fifo, nice=nice, busy_poll_us=busy_poll_us))
         # Completed requests end up on the fd pipe, complete callback called
         self._loop.add_reader(self._ae_loop.get_out_fd(), self._complete)
+        self._same_thread = same_thread
+        self._timer = None
         if same_thread:
-            self._loop.call_later(0, self._same_thread_runner)
+            # Run the event loop in the asyncio thread, which allows use of the python debugger and
+            # profiler: asyncio watches the loop's poll fd and its next timer, and calls once()
+            self._loop.add_reader(self._ae_loop.get_poll_fd(), self._same_thread_runner)
+            self._loop.call_soon(self._same_thread_runner)
         else:
             self._run_in_thread()
 
     def _same_thread_runner(self):
-        """Start event loop in normal python thread, allows use of python debugger and profiler"""
         self._ae_loop.once()
-        self._loop.call_later(0.001, self._same_thread_runner)
+        if self._timer is not None:
+            self._timer.cancel()
+            self._timer = None
+        deadline = self._ae_loop.get_next_deadline()
+        if deadline is not None:
+            self._timer = self._loop.call_at(deadline, self._same_thread_runner)
 
     def _run_in_thread(self):
         if not self._running:
@@ -440,16 +669,88 @@ class EventLoop:
     def stop(self):
         if self._running:
             self._ae_loop.stop()
+        elif getattr(self, '_same_thread', False):
+            self._same_thread = False
+            self._loop.remove_reader(self._ae_loop.get_poll_fd())
+            if self._timer is not None:
+                self._timer.cancel()
 
     def __del__(self):
         self.stop()
 
     def _complete(self):
-        for error, response, future in self._ae_loop.get_completed():
-            if response is not None:
-                future.set_result(response)
-            else:
-                future.set_exception(RequestError(error))
+        _resolve_completed(self._ae_loop)
+
+    def session(self, body_mode=None, max_handles=None):
+        return Session(self._ae_loop, self._loop, body_mode, max_handles)
+
+    def get_stats(self):
+        """Counters from the event loop thread, e.g. admission batch sizes"""
+        return self._ae_loop.get_stats()
+
+    @property
+    def thread_id(self):
+        """The event loop thread's TID, e.g. for perf -t, or None before it starts"""
+        return self._ae_loop.get_thread_id()
+
+
+class EventLoopPool:
+    """Several event loops, each with its own curl multi handle and its own
+    thread pinned to a CPU, so that TLS and decompression work is spread
+    over cores.  All of them hand their completions to the first loop, so
+    asyncio only watches one fd.
 
-    def session(self):
-        return Session(self._ae_loop, self._loop)
+    Sessions are bound to one loop: round-robin, or by host when one is given
+    so that connections to a host are reused from the same loop.
+    """
+
+    def __init__(self, n, loop=None, cpus=None, max_admission_batch=None, backend=None,
+                 sched_fifo=None, nice=None, busy_poll_us=None):
+        if n < 1:
+            raise ValueError('n must be at least 1')
+        self._loop = loop if loop is not None else asyncio.get_event_loop()
+        cpus = sorted(cpus if cpus is not None else os.sched_getaffinity(0))
+        kwargs = _ae_loop_kwargs(max_admission_batch=max_admission_batch, backend=backend,
+                                 sched_fifo=sched_fifo, nice=nice, busy_poll_us=busy_poll_us)
+        first = _acurl.EventLoop(cpus={cpus[0]}, **kwargs)
+        self._ae_loops = [first] + [_acurl.EventLoop(completions_to=first, cpus={cpus[i % len(cpus)]}, **kwargs)
+                                    for i in range(1, n)]
+        self._round_robin = itertools.count()
+        self._loop.add_reader(first.get_out_fd(), self._complete)
+        self._running = True
+        self._threads = []
+        for ae_loop in self._ae_loops:
+            thread = threading.Thread(target=ae_loop.main, daemon=True)
+            thread.start()
+            self._threads.append(thread)
+
+    def stop(self):
+        if getattr(self, '_running', False):
+            self._running = False
+            for ae_loop in self._ae_loops:
+                ae_loop.stop()
+
+    def __del__(self):
+        self.stop()
+
+    def _complete(self):
+        _resolve_completed(self._ae_loops[0])
+
+    def __len__(self):
+        return len(self._ae_loops)
+
+    def session(self, host=None, body_mode=None, max_handles=None):
+        if host is None:
+            index = next(self._round_robin) % len(self._ae_loops)
+        else:
+            index = zlib.crc32(host.encode()) % len(self._ae_loops)
+        return Session(self._ae_loops[index], self._loop, body_mode, max_handles)
+
+    def get_stats(self):
+        """get_stats() of each loop"""
+        return [ae_loop.get_stats() for ae_loop in self._ae_loops]
+
+    @property
+    def thread_ids(self):
+        """TID of each loop's thread, or None for one that hasn't started"""
+        return [ae_loop.get_thread_id() for ae_loop in self._ae_loops]
@@ -0,0 +1,83 @@
+"""Compare the event loop's polling backends (epoll and io_uring).
+
+Runs a local HTTP server in a child process, then for each backend keeps
+`connections` requests in flight for `duration` seconds and prints the
+requests per second and the client's CPU time per request.  Pass `close` to
+have the server close every connection, so that each request also opens and
+registers a new socket.
+
+    python bench_backends.py 2000 10 [close]
+"""
+import asyncio
+import multiprocessing
+import resource
+import socket
+import sys
+import time
+import acurl
+
+
+def serve(sock, close):
+    response = b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\n'
+    response += b'Connection: close\r\n\r\nok' if close else b'\r\nok'
+
+    async def handle(reader, writer):
+        try:
+            while True:
+                await reader.readuntil(b'\r\n\r\n')
+                writer.write(response)
+                await writer.drain()
+                if close:
+                    break
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        writer.close()
+
+    loop = asyncio.new_event_loop()
+    loop.run_until_complete(asyncio.start_server(handle, sock=sock, backlog=65535))
+    loop.run_forever()
+
+
+async def runner(session, url, end_t):
+    i = 0
+    while time.monotonic() < end_t:
+        await session.get(url)
+        i += 1
+    return i
+
+
+async def bench(backend, url, connections, duration):
+    el = acurl.EventLoop(backend=backend)
+    session = el.session()
+    await asyncio.gather(*[session.get(url) for i in range(connections)])  # warm up
+    start = resource.getrusage(resource.RUSAGE_SELF)
+    end_t = time.monotonic() + duration
+    count = sum(await asyncio.gather(*[runner(session, url, end_t) for i in range(connections)]))
+    end = resource.getrusage(resource.RUSAGE_SELF)
+    stats = el.get_stats()
+    el.stop()
+    cpu = (end.ru_utime - start.ru_utime) + (end.ru_stime - start.ru_stime)
+    return stats['backend'], count, cpu
+
+
+def main(connections, duration, close):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    sock = socket.socket()
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(('127.0.0.1', 0))
+    url = 'http://127.0.0.1:{}/'.format(sock.getsockname()[1])
+    server = multiprocessing.Process(target=serve, args=(sock, close), daemon=True)
+    server.start()
+    try:
+        for backend in ('epoll', 'io_uring'):
+            name, count, cpu = asyncio.get_event_loop().run_until_complete(
+                bench(backend, url, connections, duration))
+            print('{:<9} TPS: {:>10.0f}  CPU us/request: {:>7.1f}'.format(
+                name, count / duration, cpu * 1e6 / max(count, 1)))
+    finally:
+        server.terminate()
+
+
+if __name__ == "__main__":
+    main(int(sys.argv[1]), int(sys.argv[2]), len(sys.argv) > 3 and sys.argv[3] == 'close')
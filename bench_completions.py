@@ -0,0 +1,73 @@
+"""Microbenchmark of resolving completed requests' futures.
+
+Pushes `count` dummy requests (which complete without any I/O) through an
+event loop in batches, waits for each batch to complete and times resolving
+their futures, either the old way, with a python
+loop over get_completed()'s list of tuples, or with resolve_completed() in
+C.  Prints completions per second for each.
+
+    python bench_completions.py 200000
+"""
+import asyncio
+import select
+import sys
+import threading
+import time
+import _acurl
+import acurl
+
+
+def python_loop(ae_loop):
+    n = 0
+    for error, response, future in ae_loop.get_completed():
+        if response is not None:
+            future.set_result(response)
+        else:
+            future.set_exception(acurl.RequestError(error))
+        n += 1
+    return n
+
+
+def in_c(ae_loop):
+    return ae_loop.resolve_completed(acurl.RequestError)
+
+
+def bench(resolve, count, batch=10000, settle=0.1):
+    loop = asyncio.new_event_loop()
+    ae_loop = _acurl.EventLoop()
+    threading.Thread(target=ae_loop.main, daemon=True).start()
+    session = _acurl.Session(ae_loop)
+    out_fd = ae_loop.get_out_fd()
+    resolved = 0
+    elapsed = 0.0
+    while resolved < count:
+        futures = [loop.create_future() for _ in range(batch)]
+        for future in futures:
+            session.request(future, 'GET', '', headers=(), cookies=None, auth=None, data=None,
+                            dummy=True, cert=None)
+        # Let the loop thread finish the batch, so that only resolving is timed
+        time.sleep(settle)
+        done = 0
+        while done < batch:
+            select.select([out_fd], [], [])
+            start = time.perf_counter()
+            done += resolve(ae_loop)
+            elapsed += time.perf_counter() - start
+        assert all(f.done() for f in futures)
+        resolved += done
+        # Responses hand their curl handles back to the loop thread, so
+        # they have to go while it's still running
+        del futures
+    ae_loop.stop()
+    loop.close()
+    return resolved / elapsed
+
+
+def main(count):
+    for name, resolve in (('get_completed + python loop', python_loop),
+                          ('resolve_completed', in_c)):
+        print('{:<28} {:>10.0f} completions/s'.format(name, bench(resolve, count)))
+
+
+if __name__ == "__main__":
+    main(int(sys.argv[1]) if len(sys.argv) > 1 else 200000)
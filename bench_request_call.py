@@ -0,0 +1,88 @@
+"""Microbenchmark of the per-call cost of the hot C entry points.
+
+Times Session.request() called with keyword arguments, as acurl.Session
+calls it, PreparedRequest.send(), Session.request_many() per request, and a
+Response getter.  request() makes dummies, which complete without any I/O;
+the others go to a closed local port and fail straight away.  Only the
+calls themselves are timed.  Prints nanoseconds per call.
+
+    python bench_request_call.py 200000
+"""
+import asyncio
+import select
+import sys
+import threading
+import time
+import _acurl
+import acurl
+
+REFUSED_URL = 'http://127.0.0.1:1/'
+
+
+def drain(ae_loop, count):
+    done = 0
+    while done < count:
+        select.select([ae_loop.get_out_fd()], [], [])
+        done += ae_loop.resolve_completed(acurl.RequestError)
+
+
+def bench(count, batch=10000):
+    loop = asyncio.new_event_loop()
+    ae_loop = _acurl.EventLoop()
+    threading.Thread(target=ae_loop.main, daemon=True).start()
+    session = _acurl.Session(ae_loop)
+    headers = ('Accept: application/json', 'X-Request-Id: 1')
+    prepared = session.prepare('GET', REFUSED_URL, headers=headers)
+    timings = {'request': 0.0, 'prepared.send': 0.0, 'request_many': 0.0, 'get_response_code': 0.0}
+    calls = 0
+    while calls < count:
+        futures = [loop.create_future() for _ in range(batch)]
+        request = session.request
+        start = time.perf_counter()
+        for future in futures:
+            request(future, 'GET', 'http://localhost/', headers=headers, cookies=None, auth=None,
+                    data=None, dummy=True, cert=None, body_mode=None)
+        timings['request'] += time.perf_counter() - start
+        drain(ae_loop, batch)
+        response = futures[0].result()
+
+        futures = [loop.create_future() for _ in range(batch)]
+        send = prepared.send
+        start = time.perf_counter()
+        for future in futures:
+            send(future)
+        timings['prepared.send'] += time.perf_counter() - start
+        drain(ae_loop, batch)
+        for future in futures:
+            future.exception()
+
+        futures = [loop.create_future() for _ in range(batch)]
+        requests = [(future, 'GET', REFUSED_URL, headers, None, None, None, None) for future in futures]
+        start = time.perf_counter()
+        session.request_many(requests)
+        timings['request_many'] += time.perf_counter() - start
+        drain(ae_loop, batch)
+        for future in futures:
+            future.exception()
+
+        get_response_code = response.get_response_code
+        start = time.perf_counter()
+        for _ in range(batch):
+            get_response_code()
+        timings['get_response_code'] += time.perf_counter() - start
+        # Responses hand their curl handles back to the loop thread, so
+        # they have to go while it's still running
+        del futures, requests, response, get_response_code
+        calls += batch
+    ae_loop.stop()
+    loop.close()
+    return {name: elapsed / calls * 1e9 for name, elapsed in timings.items()}
+
+
+def main(count):
+    for name, ns in bench(count).items():
+        print('{:<20} {:>8.0f} ns/call'.format(name, ns))
+
+
+if __name__ == "__main__":
+    main(int(sys.argv[1]) if len(sys.argv) > 1 else 200000)
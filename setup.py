@@ -11,9 +11,15 @@ with open(os.path.join('acurl', 'version.py')) as f:
 # Building without nanoconfig
 cpy_extension = Extension('_acurl',
                           sources=['src/acurl.c',
+                                   'src/ring.c',
+                                   'src/pool.c',
                                    'src/event-loop.c',
+                                   'src/file.c',
+                                   'src/json.c',
+                                   'src/prepared.c',
                                    'src/response.c',
                                    'src/session.c',
+                                   'src/stream.c',
                                    'src/ae/ae.c',
                                    'src/ae/zmalloc.c'
                                    ],
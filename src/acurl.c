@@ -2,14 +2,27 @@
 
 /* Helper functions */
 
-void free_buffer_nodes(BufferNode *start) {
+/* Give a list of buffer nodes back to the pool of the loop they came from */
+void free_buffer_nodes(EventLoop *loop, BufferNode *start) {
     BufferNode *node = start;
-    while(node != NULL)
+    size_t count = 1;
+    if(start == NULL) {
+        return;
+    }
+    while(node->next != NULL)
     {
-        BufferNode *next = node->next;
-        free(node->buffer);
-        free(node);
-        node = next;
+        node = node->next;
+        count++;
+    }
+    pool_put_chain(&loop->buffer_pool, start, node, count);
+}
+
+void free_header_buffer(EventLoop *loop, HeaderBuffer *header) {
+    if(header->pooled) {
+        pool_put(&loop->buffer_pool, header->data);
+    }
+    else {
+        free(header->data);
     }
 }
 
@@ -28,20 +41,111 @@ static void schedule_cleanup_curl_pointer(int fd, CleanupPointerType type, void
     }
 }
 
-void schedule_cleanup_curl_share(Session *session, CURLSH *share) {
+void schedule_cleanup_session(Session *session) {
     schedule_cleanup_curl_pointer(session->loop->curl_easy_cleanup_write,
-                                  CleanupShare,
-                                  (void*)share);
+                                  CleanupSession,
+                                  (void*)session->handles);
 }
 
 void schedule_cleanup_curl_easy(Session *session, CURL *ptr) {
+    /* Nothing else uses the handle now, see handle_pool_put */
+    curl_easy_setopt(ptr, CURLOPT_PRIVATE, session->handles);
     schedule_cleanup_curl_pointer(session->loop->curl_easy_cleanup_write,
                                   CleanupEasy,
                                   (void*)ptr);
 }
 
+/* Argument parsing for METH_FASTCALL | METH_KEYWORDS methods, which get
+   their arguments as an array instead of a tuple and dict.  names are the
+   parameters' names, the first required of which have to be given, and
+   interned is a static array for the same names as interned strings,
+   filled in on first use.  Keyword names in calls from python code are
+   interned too, so they are matched by pointer.  values[i] gets a borrowed
+   reference to each argument, or NULL if it wasn't given. */
+bool parse_fastcall_args(const char *fname, const char *const *names, PyObject **interned,
+                         Py_ssize_t count, Py_ssize_t required,
+                         PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                         PyObject **values)
+{
+    if(unlikely(interned[0] == NULL)) {
+        /* Backwards, so that interned[0] is only set once they all are */
+        for(Py_ssize_t i = count - 1; i >= 0; i--) {
+            if((interned[i] = PyUnicode_InternFromString(names[i])) == NULL) {
+                return false;
+            }
+        }
+    }
+    if(nargs > count) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd arguments (%zd given)", fname, count, nargs);
+        return false;
+    }
+    for(Py_ssize_t i = 0; i < count; i++) {
+        values[i] = i < nargs ? args[i] : NULL;
+    }
+    if(kwnames != NULL) {
+        for(Py_ssize_t k = 0; k < PyTuple_GET_SIZE(kwnames); k++) {
+            PyObject *key = PyTuple_GET_ITEM(kwnames, k);
+            Py_ssize_t i = 0;
+            while(i < count && interned[i] != key) {
+                i++;
+            }
+            if(unlikely(i == count)) {
+                for(i = 0; i < count && PyUnicode_Compare(interned[i], key) != 0; i++);
+                if(i == count) {
+                    PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", fname, key);
+                    return false;
+                }
+            }
+            if(values[i] != NULL) {
+                PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", fname, names[i]);
+                return false;
+            }
+            values[i] = args[nargs + k];
+        }
+    }
+    for(Py_ssize_t i = 0; i < required; i++) {
+        if(values[i] == NULL) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s' (pos %zd)", fname, names[i], i + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* A str argument as UTF-8, like PyArg_Parse's "s", or with allow_none also
+   None as NULL, like "z".  As with those, embedded NULs are refused, since
+   the string would be cut short at the first.  A missing argument is left
+   alone. */
+bool parse_string_arg(const char *fname, const char *name, PyObject *value, bool allow_none, const char **out)
+{
+    const char *str;
+    Py_ssize_t len;
+    if(value == NULL || (allow_none && value == Py_None)) {
+        return true;
+    }
+    if(!PyUnicode_Check(value)) {
+        PyErr_Format(PyExc_TypeError, "%s() argument '%s' must be str%s, not %.50s",
+                     fname, name, allow_none ? " or None" : "", Py_TYPE(value)->tp_name);
+        return false;
+    }
+    str = PyUnicode_AsUTF8AndSize(value, &len);
+    if(str == NULL) {
+        return false;
+    }
+    if(strlen(str) != (size_t)len) {
+        PyErr_Format(PyExc_ValueError, "%s() argument '%s' must not contain null characters", fname, name);
+        return false;
+    }
+    *out = str;
+    return true;
+}
+
 /* Module definition */
 
+PyObject *str_done;
+PyObject *str_set_result;
+PyObject *str_set_exception;
+
 static const char MODULE_NAME[] = "_acurl";
 
 
@@ -79,6 +183,15 @@ PyInit__acurl(void)
     if (PyType_Ready(&ResponseType) < 0)
         return NULL;
 
+    if (PyType_Ready(&PreparedRequestType) < 0)
+        return NULL;
+
+    str_done = PyUnicode_InternFromString("done");
+    str_set_result = PyUnicode_InternFromString("set_result");
+    str_set_exception = PyUnicode_InternFromString("set_exception");
+    if (str_done == NULL || str_set_result == NULL || str_set_exception == NULL)
+        return NULL;
+
     m = PyModule_Create(&_acurl_module);
 
     if(m != NULL) {
@@ -89,6 +202,8 @@ PyInit__acurl(void)
         PyModule_AddObject(m, "EventLoop", (PyObject *)&EventLoopType);
         Py_INCREF(&ResponseType);
         PyModule_AddObject(m, "Response", (PyObject *)&ResponseType);
+        Py_INCREF(&PreparedRequestType);
+        PyModule_AddObject(m, "PreparedRequest", (PyObject *)&PreparedRequestType);
     }
 
     return m;
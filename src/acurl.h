@@ -2,18 +2,73 @@
 
 #define _ACURL_H
 
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>  /* first, as it sets _GNU_SOURCE for cpu_set_t */
 #include "ae/ae.h"
 #include <curl/multi.h>
-#include <Python.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <endian.h>
 #include "structmember.h"
 
 #define NO_ACTIVE_TIMER_ID -1
 
+/* Initial size of the event loop's fd table.  It grows as sockets with
+ * higher fds are registered, so this only needs to cover the common case */
+#define INITIAL_SETSIZE 1024
+
+/* Capacity of the request and completion rings; rounded up to a power of
+ * two */
+#define REQUEST_QUEUE_SIZE 65536
+
+/* Default cap on the number of requests start_request admits per wakeup,
+ * so that a burst of submissions can't starve socket events */
+#define DEFAULT_ADMISSION_BATCH 256
+
+/* Batch sizes are counted in power of two buckets: [1], [2,3], [4,7], ... */
+#define ADMISSION_HISTOGRAM_BUCKETS 16
+
+/* How long to wait before retrying completions which didn't fit in a full
+ * completion ring */
+#define COMPLETION_RETRY_MS 1
+
+/* Size of the blocks response headers and bodies are collected in,
+ * including the BufferNode header.  Each event loop keeps up to
+ * BUFFER_POOL_MAX_FREE of them around for reuse, and up to
+ * REQUEST_POOL_MAX_FREE spare AcRequestData */
+#define BUFFER_CHUNK_SIZE 4096
+#define BUFFER_POOL_MAX_FREE 4096
+#define REQUEST_POOL_MAX_FREE 4096
+
+/* A response body is allocated up front from its Content-Length, up to
+ * MAX_BODY_PRESIZE, otherwise it starts at INITIAL_BODY_SIZE.  Either way it
+ * doubles whenever it fills up */
+#define INITIAL_BODY_SIZE 16384
+#define MAX_BODY_PRESIZE (64 * 1024 * 1024)
+
+/* Most body chunks a streamed response buffers before its transfer is
+ * paused; a power of two, and enough for one of curl's writes */
+#define STREAM_QUEUE_CHUNKS 64
+
+/* Request bodies up to this size are given to curl as POSTFIELDS, which it
+ * sends along with the headers.  Bigger ones are read straight out of the
+ * caller's buffer by read_callback, a piece at a time */
+#define MAX_INLINE_REQUEST_BODY (64 * 1024)
+
+/* Bodies downloaded to a file opened with O_DIRECT are written in batches
+ * of FILE_DIRECT_BATCH_SIZE, from a buffer aligned to FILE_DIRECT_ALIGN */
+#define FILE_DIRECT_BATCH_SIZE (1024 * 1024)
+#define FILE_DIRECT_ALIGN 4096
+
+/* Most idle easy handles a session keeps for reuse, unless it is given
+ * max_handles */
+#define DEFAULT_HANDLE_POOL_SIZE 256
+
 /* Macros for debugging */
 
 #define DEBUG 0
@@ -50,9 +105,11 @@
 
 /* Cleanup helpers */
 
+/* An easy handle to give back to the AcHandlePool in its CURLOPT_PRIVATE,
+   or a session's AcHandlePool to free, along with its share */
 typedef enum {
     CleanupEasy,
-    CleanupShare
+    CleanupSession
 } CleanupPointerType;
 
 typedef struct {
@@ -60,18 +117,140 @@ typedef struct {
     void *ptr;
 } CleanupData;
 
+/* A session's idle easy handles, reset and ready for reuse.  Only the
+   event loop thread touches it once the session has been created.  It
+   owns the session's share, which has to outlive the handles attached to
+   it. */
+typedef struct {
+    CURLSH *shared;
+    CURL **handles;
+    size_t count;
+    size_t max;
+} AcHandlePool;
+
+/* What happens to a response body: stored for get_body(), dropped,
+   dropped after being run through a checksum, handed over in pieces as it
+   arrives, see stream.c, or written to a file, see file.c */
+
+typedef enum {
+    BodyStore,
+    BodyDiscard,
+    BodyCount,
+    BodyStream,
+    BodyFile
+} BodyMode;
+
+/* Lock-free queue used to hand requests between threads, see ring.c */
+
+typedef struct {
+    _Atomic size_t seq;
+    void *data;
+} AcRingCell;
+
+typedef struct {
+    AcRingCell *cells;
+    size_t mask;
+    int fd;                     /* eventfd, readable while items are pending */
+    char pad0[64];              /* keep producers and consumer on separate cache lines */
+    _Atomic size_t head;        /* next cell to push to */
+    char pad1[64];
+    size_t tail;                /* next cell to pop from; consumer only */
+    _Atomic long pending;
+} AcRing;
+
+/* Freelist of fixed-size blocks, see pool.c */
+
+typedef struct _AcPoolItem {
+    struct _AcPoolItem *next;
+} AcPoolItem;
+
+typedef struct {
+    size_t item_size;
+    size_t max_free;
+    AcPoolItem *free;                   /* owner thread only */
+    _Atomic(AcPoolItem *) returned;     /* given back by any thread */
+    _Atomic size_t in_use;
+    /* Written by the owner thread, read without synchronisation */
+    unsigned long long hits;
+    unsigned long long misses;
+    size_t high_water;                  /* most blocks in use at once */
+} AcPool;
+
 /* Structs */
 
+struct _AcRequestData;
+
+/* Counters maintained by the event loop thread.  They are read from the
+   python thread without synchronisation, so a snapshot may be slightly
+   stale. */
+typedef struct {
+    unsigned long long admission_batches;
+    unsigned long long admission_requests;
+    unsigned long long admission_max_batch;
+    unsigned long long admission_capped;
+    unsigned long long admission_histogram[ADMISSION_HISTOGRAM_BUCKETS];
+    unsigned long long immediate_timeouts;
+    unsigned long long completed_requests;
+    unsigned long long easy_handles_created;
+    unsigned long long easy_handles_reused;
+    unsigned long long easy_handles_returned; /* by responses, for the pool */
+    /* Busy polling: non-blocking polls, those which found something to do,
+       blocking polls, and time spent polling versus handling events */
+    unsigned long long busy_poll_spins;
+    unsigned long long busy_poll_hits;
+    unsigned long long busy_poll_blocks;
+    unsigned long long busy_poll_spin_ns;
+    unsigned long long busy_poll_work_ns;
+} AcLoopStats;
+
+/* State attached to each of curl's sockets with curl_multi_assign */
 typedef struct {
+    int mask; /* AE_READABLE/AE_WRITABLE events registered with ae */
+} AcSocket;
+
+typedef struct _EventLoop {
     PyObject_HEAD
     aeEventLoop *event_loop;
     CURLM *multi;
     long long timer_id;
     bool stop;
-    int req_in_read;
-    int req_in_write;
-    int req_out_read;
-    int req_out_write;
+    AcRing req_in;
+    /* Paused streams whose reader has caught up, pushed by the python
+       thread and resumed by the loop thread when req_in's eventfd fires */
+    _Atomic(struct _AcStream *) resume;
+    AcRing req_out;
+    /* Where completions are pushed: req_out, or the req_out of
+       completion_loop when this loop's completions are merged into it */
+    AcRing *completed;
+    struct _EventLoop *completion_loop;
+    /* Completions which didn't fit into req_out, oldest first.  Only touched
+       by the event loop thread */
+    struct _AcRequestData *req_out_overflow_head;
+    struct _AcRequestData *req_out_overflow_tail;
+    long long req_out_retry_timer_id;
+    int max_admission_batch;
+    /* While start_request is adding a batch of handles, curl's timer
+       updates are deferred and replaced by a single kick at the end */
+    bool admitting;
+    bool timer_deferred;
+    long deferred_timeout_ms;
+    /* Curl asked for a zero timeout; run it before the loop next sleeps
+       instead of going through a timer */
+    bool kick_pending;
+    AcLoopStats stats;
+    /* Scheduling for the loop thread, applied when main() starts */
+    bool has_cpus;
+    cpu_set_t cpus;
+    int sched_fifo;  /* SCHED_FIFO priority, 0 to leave the policy alone */
+    bool has_nice;
+    int nice;
+    _Atomic pid_t thread_id;  /* of the thread running main(), 0 before */
+    long long busy_poll_ns;  /* 0 unless busy polling */
+    /* AcRequestData are taken from request_pool by the python thread, and
+       buffer chunks from buffer_pool by the event loop thread.  Either may
+       be given back from the python thread. */
+    AcPool request_pool;
+    AcPool buffer_pool;
     int stop_read;
     int stop_write;
     int curl_easy_cleanup_read;
@@ -82,23 +261,106 @@ typedef struct {
     PyObject_HEAD
     EventLoop *loop;
     CURLSH *shared;
+    AcHandlePool *handles;
 } Session;
 
+/* A request template, see prepared.c.  Nothing in it changes after it is
+   made, so the event loop thread reads it without the GIL. */
+typedef struct {
+    PyObject_HEAD
+    Session *session;
+    char *method;
+    char *url;
+    size_t url_len;
+    char *auth;
+    char *ca_cert;
+    char *ca_key;
+    struct curl_slist *headers;
+    BodyMode body_mode;
+} PreparedRequest;
+
 /* Node in a linked list structure. Used for piecing together sections of
- * resposnes e.g. headers and body.  A possible optimisation would be to have
- * a memory pool for buffer nodes so they aren't being malloc'ed all the
- * time */
+ * resposnes e.g. headers and body.  Nodes are BUFFER_CHUNK_SIZE blocks from
+ * the event loop's buffer_pool, filled up before the next one is started.
+ * next must come first so that a list can go back to the pool as it is. */
 
 typedef struct _BufferNode {
-    size_t len;
-    char *buffer;
     struct _BufferNode *next;
+    size_t len;
+    char buffer[];
 } BufferNode;
 
+#define BUFFER_NODE_CAPACITY (BUFFER_CHUNK_SIZE - offsetof(BufferNode, buffer))
+
+/* Response headers: the text of the header block, with a table of where
+ * each field's name and value are.  The text fills the block from the start
+ * and the table from the end, so they only need one allocation, which to
+ * begin with is a chunk from the buffer pool.  Both start again with each
+ * status line, so only the last response's headers are kept, e.g. not those
+ * of a 100 Continue. */
+typedef struct {
+    uint32_t name;  /* offsets into the text */
+    uint32_t name_len;
+    uint32_t value;
+    uint32_t value_len;
+} HeaderField;
+
+typedef struct {
+    char *data;
+    size_t len;     /* of the text */
+    size_t size;
+    size_t count;   /* of the fields */
+    bool pooled;
+} HeaderBuffer;
+
+#define HEADER_FIELD(header, i) (((HeaderField *)((header)->data + (header)->size)) - 1 - (i))
+
+/* A response body, in one malloc'ed block */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} BodyBuffer;
+
+/* Where a body downloaded to a file goes.  Only the event loop thread
+   touches it once the request has been queued. */
+typedef struct {
+    int fd;
+    bool direct;                  /* opened with O_DIRECT, see batch */
+    bool preallocated;
+    char *batch;                  /* with direct, FILE_DIRECT_BATCH_SIZE */
+    size_t batch_len;
+    off_t written;                /* bytes written to fd, not in batch */
+} AcFileSink;
+
+struct _Response;
+
+/* A streamed response body.  The event loop thread fills BufferNodes and
+   queues them; the python thread reads them off, and resumes the transfer
+   through the loop's resume stack if the full queue paused it. */
+typedef struct _AcStream {
+    BufferNode *chunks[STREAM_QUEUE_CHUNKS];
+    _Atomic size_t head;          /* next chunk to queue; loop thread */
+    _Atomic size_t tail;          /* next chunk to read; python thread */
+    _Atomic bool paused;          /* the transfer is waiting to be resumed */
+    _Atomic bool notified;        /* queued on the completion ring */
+    _Atomic bool done;            /* the transfer has finished */
+    _Atomic bool abandoned;       /* the response was dropped */
+    bool headers_done;            /* loop thread only */
+    /* Python thread only */
+    bool started;                 /* the response has been handed out */
+    bool finished;                /* done, and the request data freed */
+    CURLcode result;
+    struct _AcRequestData *rd;
+    struct _Response *response;
+    PyObject *waiter;             /* future to resolve on the next chunk */
+    struct _AcStream *resume_next; /* on the loop's resume stack */
+} AcStream;
+
 /* TODO: the fields marked xxx below are freed in session_request.  We might
    want to split them out into their own struct (as a start has been made at
    below), to better reflect their lifetime */
-typedef struct {
+typedef struct _AcRequestData {
     char* method;         /* xxx */
     char* url;            /* xxx */
     char* auth;           /* xxx */
@@ -107,18 +369,24 @@ typedef struct {
     char** cookies_str;   /* xxx */
     PyObject* future;
     struct curl_slist* headers;
-    int req_data_len;           /* xxx? */
-    char* req_data_buf;   /* xxx? */
+    Py_buffer req_data;   /* request body, released in take_completed */
+    size_t req_data_sent; /* with read_callback */
     Session* session;
     CURL *curl;
     CURLcode result;
-    BufferNode *header_buffer_head;
-    BufferNode *header_buffer_tail;
-    BufferNode *body_buffer_head;
-    BufferNode *body_buffer_tail;
+    HeaderBuffer header;
+    BodyBuffer body;
+    BodyMode body_mode;
+    uint64_t body_checksum;  /* with BodyCount, see checksum_callback */
+    uint64_t checksum_word;  /* bytes not yet in the checksum */
+    unsigned int checksum_word_len;
+    AcStream *stream;        /* with BodyStream */
+    AcFileSink *file;        /* with BodyFile */
+    PreparedRequest *prepared;  /* what method, url etc. don't set */
     int dummy;
     char* ca_cert;        /* xxx */
     char* ca_key;         /* xxx */
+    struct _AcRequestData *next;  /* link in req_out_overflow */
 } AcRequestData;
 
 /* TODO not used yet, see above */
@@ -131,10 +399,14 @@ typedef struct {
     const char** cookies_str;
 } AcRequestDataStartInfo;
 
-typedef struct {
+typedef struct _Response {
     PyObject_HEAD
-    BufferNode *header_buffer;
-    BufferNode *body_buffer;
+    HeaderBuffer header;
+    BodyBuffer body;
+    Py_ssize_t exports;  /* buffer views of the body */
+    BodyMode body_mode;
+    uint64_t body_checksum;
+    AcStream *stream;
     Session *session;
     CURL *curl;
 } Response;
@@ -144,10 +416,60 @@ typedef struct {
 extern PyTypeObject EventLoopType;
 extern PyTypeObject ResponseType;
 extern PyTypeObject SessionType;
+extern PyTypeObject PreparedRequestType;
+/* Interned names of the asyncio.Future methods called from C */
+extern PyObject *str_done;
+extern PyObject *str_set_result;
+extern PyObject *str_set_exception;
 void start_request(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
-void free_buffer_nodes(BufferNode *start);
-void schedule_cleanup_curl_share(Session *session, CURLSH *share);
+void push_completed(EventLoop *loop, AcRequestData *rd);
+void finish_body_checksum(AcRequestData *rd);
+AcStream *stream_new(AcRequestData *rd);
+size_t stream_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+void stream_complete(EventLoop *loop, AcRequestData *rd);
+void stream_headers_complete(EventLoop *loop, AcRequestData *rd);
+void stream_resume(AcRequestData *rd);
+void stream_resume_all(EventLoop *loop);
+bool take_stream_event(AcRequestData *rd, PyObject **future, PyObject **value);
+PyObject *stream_read(Response *response, PyObject *waiter);
+bool stream_release(Response *response);
+AcFileSink *file_sink_open(const char *path, bool direct);
+size_t file_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+bool file_sink_close(AcFileSink *file);
+void socket_action_and_response_complete(EventLoop *loop, curl_socket_t socket, int ev_bitmask);
+void apply_deferred_timer(EventLoop *loop);
+int ring_init(AcRing *ring, size_t size);
+void ring_free(AcRing *ring);
+bool ring_push(AcRing *ring, void *data);
+bool ring_push_many(AcRing *ring, void **items, size_t count);
+void *ring_pop(AcRing *ring);
+void ring_clear_signal(AcRing *ring);
+void ring_wakeup(AcRing *ring);
+void pool_init(AcPool *pool, size_t item_size, size_t max_free);
+void pool_free_all(AcPool *pool);
+void *pool_get(AcPool *pool);
+void pool_put(AcPool *pool, void *item);
+void pool_put_chain(AcPool *pool, void *first, void *last, size_t count);
+PyObject *json_loads(const char *data, size_t len);
+void free_buffer_nodes(EventLoop *loop, BufferNode *start);
+void free_header_buffer(EventLoop *loop, HeaderBuffer *header);
+void schedule_cleanup_session(Session *session);
 void schedule_cleanup_curl_easy(Session *session, CURL *ptr);
+CURL *handle_pool_get(EventLoop *loop, Session *session);
+void handle_pool_put(AcHandlePool *handles, CURL *curl);
+void handle_pool_free(AcHandlePool *handles);
+bool parse_body_mode(const char *body_mode, BodyMode *mode);
+bool build_header_list(PyObject *headers, struct curl_slist **list);
+bool format_auth(PyObject *auth, char **userpwd);
+bool copy_cert(PyObject *cert, char **cert_path, char **key_path);
+bool get_request_body(PyObject *data, Py_buffer *view);
+bool queue_request(Session *session, AcRequestData *rd, PyObject *future);
+PyObject *prepared_new(Session *session, PyObject *args, PyObject *kwds);
+bool parse_fastcall_args(const char *fname, const char *const *names, PyObject **interned,
+                         Py_ssize_t count, Py_ssize_t required,
+                         PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                         PyObject **values);
+bool parse_string_arg(const char *fname, const char *name, PyObject *value, bool allow_none, const char **out);
 PyMODINIT_FUNC PyInit__acurl(void);
 
 #endif /* defined _ACURL_H */
@@ -61,6 +61,9 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
+    #ifdef HAVE_IO_URING
+    #include "ae_io_uring.c"
+    #else
     #ifdef HAVE_EPOLL
     #include "ae_epoll.c"
     #else
@@ -70,9 +73,64 @@
         #include "ae_select.c"
         #endif
     #endif
+    #endif
 #endif
 
+#ifndef AE_API_HAS_SET_EVENT
+/* Backends without a way to replace the events of an fd in one step get
+ * there by deleting and then adding. */
+static int aeApiSetEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    int oldmask = eventLoop->events[fd].mask;
+
+    if (oldmask & ~mask) {
+        aeApiDelEvent(eventLoop, fd, oldmask & ~mask);
+        eventLoop->events[fd].mask = oldmask & mask;
+    }
+    if (mask & ~oldmask) {
+        if (aeApiAddEvent(eventLoop, fd, mask) == -1) {
+            eventLoop->events[fd].mask = oldmask;
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+#ifndef AE_API_HAS_POLL_FD
+static int aeApiPollFd(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+    return -1;
+}
+
+static void aeApiFlush(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+}
+#endif
+
+static long long aeGetTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Read the clock once per iteration, right after polling.  Callbacks see
+ * this time, so timers created by them are relative to it.  The clock is
+ * monotonic, so unlike wall clock time it can't be set back and time
+ * events can't be delayed by clock changes. */
+static void aeUpdateTime(aeEventLoop *eventLoop) {
+    eventLoop->now = aeGetTime();
+}
+
 aeEventLoop *aeCreateEventLoop(int setsize) {
+    return aeCreateEventLoopWithApi(setsize, AE_API_DEFAULT);
+}
+
+/* Like aeCreateEventLoop(), but asks for a particular polling backend.  If
+ * it isn't available the default one is used, so check the result with
+ * aeGetEventLoopApiName(). */
+aeEventLoop *aeCreateEventLoopWithApi(int setsize, int api) {
     aeEventLoop *eventLoop;
     int i;
 
@@ -81,12 +139,19 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->fired = zmalloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->now = aeGetTime();
+    eventLoop->timeEventHeap = NULL;
+    eventLoop->timeEventCount = 0;
+    eventLoop->timeEventCapacity = 0;
+    eventLoop->timeEventBuckets = NULL;
+    eventLoop->timeEventBucketsMask = -1;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->privdata = NULL;
+    eventLoop->api = api;
+    eventLoop->apiCtlCalls = 0;
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -134,6 +199,16 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
+    for (j = 0; j < eventLoop->timeEventCount; j++) {
+        aeTimeEvent *te = eventLoop->timeEventHeap[j];
+        if (te->finalizerProc)
+            te->finalizerProc(eventLoop, te->clientData);
+        zfree(te);
+    }
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventBuckets);
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
@@ -148,10 +223,18 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData)
 {
     if (fd >= eventLoop->setsize) {
-        aeResizeSetSize(eventLoop, (int)(eventLoop->setsize * 1.5) + 1);
+        /* Grow geometrically until the fd fits, so that the fd table
+         * follows the number of sockets actually in use. */
+        int setsize = eventLoop->setsize;
+        while (setsize <= fd) setsize *= 2;
+        if (aeResizeSetSize(eventLoop, setsize) == AE_ERR) {
+            errno = ERANGE;
+            return AE_ERR;
+        }
     }
     aeFileEvent *fe = &eventLoop->events[fd];
 
+    eventLoop->apiCtlCalls++;
     if (aeApiAddEvent(eventLoop, fd, mask) == -1)
         return AE_ERR;
     fe->mask |= mask;
@@ -164,23 +247,60 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
     return AE_OK;
 }
 
+static void aeUpdateMaxFd(aeEventLoop *eventLoop) {
+    int j;
+
+    for (j = eventLoop->maxfd-1; j >= 0; j--)
+        if (eventLoop->events[j].mask != AE_NONE) break;
+    eventLoop->maxfd = j;
+}
+
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 {
     if (fd >= eventLoop->setsize) return;
     aeFileEvent *fe = &eventLoop->events[fd];
     if (fe->mask == AE_NONE) return;
 
+    eventLoop->apiCtlCalls++;
     aeApiDelEvent(eventLoop, fd, mask);
     fe->mask = fe->mask & (~mask);
-    if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
-        /* Update the max fd */
-        int j;
+    if (fd == eventLoop->maxfd && fe->mask == AE_NONE) aeUpdateMaxFd(eventLoop);
+	DEBUG_PRINT("fd=%d fe->mask=%d", fd, fe->mask);
+}
 
-        for (j = eventLoop->maxfd-1; j >= 0; j--)
-            if (eventLoop->events[j].mask != AE_NONE) break;
-        eventLoop->maxfd = j;
+/* Make mask the complete set of events watched on fd, with proc handling
+ * all of them.  Unlike a aeCreateFileEvent()/aeDeleteFileEvent() pair this
+ * changes the polling backend at most once, and not at all if the mask is
+ * the same. */
+int aeSetFileEvents(aeEventLoop *eventLoop, int fd, int mask,
+        aeFileProc *proc, void *clientData)
+{
+    if (fd >= eventLoop->setsize) {
+        if (mask == AE_NONE) return AE_OK;
+        int setsize = eventLoop->setsize;
+        while (setsize <= fd) setsize *= 2;
+        if (aeResizeSetSize(eventLoop, setsize) == AE_ERR) {
+            errno = ERANGE;
+            return AE_ERR;
+        }
     }
+    aeFileEvent *fe = &eventLoop->events[fd];
+
+    if (fe->mask != mask) {
+        eventLoop->apiCtlCalls++;
+        if (aeApiSetEvent(eventLoop, fd, mask) == -1)
+            return AE_ERR;
+    }
+    fe->mask = mask;
+    fe->rfileProc = proc;
+    fe->wfileProc = proc;
+    fe->clientData = clientData;
+    if (mask != AE_NONE && fd > eventLoop->maxfd)
+        eventLoop->maxfd = fd;
+    else if (fd == eventLoop->maxfd && mask == AE_NONE)
+        aeUpdateMaxFd(eventLoop);
 	DEBUG_PRINT("fd=%d fe->mask=%d", fd, fe->mask);
+    return AE_OK;
 }
 
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
@@ -190,158 +310,232 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
-{
-    struct timeval tv;
+/* Time events live in a binary min-heap ordered by (when, id), so the
+ * nearest timer is always timeEventHeap[0] and insertion and deletion are
+ * O(log N).  A small hash table maps ids to events so that
+ * aeDeleteTimeEvent doesn't need to search the heap. */
+
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when < b->when || (a->when == b->when && a->id < b->id);
+}
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+static void aeHeapSet(aeEventLoop *eventLoop, int index, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[index] = te;
+    te->heapIndex = index;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+static void aeHeapSiftUp(aeEventLoop *eventLoop, int index) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[index];
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    while (index > 0) {
+        int parent = (index-1)/2;
+        if (!aeTimeEventBefore(te, eventLoop->timeEventHeap[parent])) break;
+        aeHeapSet(eventLoop, index, eventLoop->timeEventHeap[parent]);
+        index = parent;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    aeHeapSet(eventLoop, index, te);
 }
 
-long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
+static void aeHeapSiftDown(aeEventLoop *eventLoop, int index) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[index];
+    int count = eventLoop->timeEventCount;
+
+    while (1) {
+        int child = index*2+1;
+        if (child >= count) break;
+        if (child+1 < count &&
+            aeTimeEventBefore(eventLoop->timeEventHeap[child+1],
+                              eventLoop->timeEventHeap[child]))
+            child++;
+        if (!aeTimeEventBefore(eventLoop->timeEventHeap[child], te)) break;
+        aeHeapSet(eventLoop, index, eventLoop->timeEventHeap[child]);
+        index = child;
+    }
+    aeHeapSet(eventLoop, index, te);
+}
+
+static int aeHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventCount == eventLoop->timeEventCapacity) {
+        int capacity = eventLoop->timeEventCapacity ?
+            eventLoop->timeEventCapacity*2 : 16;
+        aeTimeEvent **heap = zrealloc(eventLoop->timeEventHeap,
+                                      sizeof(aeTimeEvent*)*capacity);
+        if (heap == NULL) return AE_ERR;
+        eventLoop->timeEventHeap = heap;
+        eventLoop->timeEventCapacity = capacity;
+    }
+    eventLoop->timeEventHeap[eventLoop->timeEventCount++] = te;
+    aeHeapSiftUp(eventLoop, eventLoop->timeEventCount-1);
+    return AE_OK;
+}
+
+static void aeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int index = te->heapIndex;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventCount];
+
+    te->heapIndex = -1;
+    if (last == te) return;
+    aeHeapSet(eventLoop, index, last);
+    if (index > 0 && aeTimeEventBefore(last, eventLoop->timeEventHeap[(index-1)/2]))
+        aeHeapSiftUp(eventLoop, index);
+    else
+        aeHeapSiftDown(eventLoop, index);
+}
+
+static aeTimeEvent **aeHashSlot(aeEventLoop *eventLoop, long long id) {
+    return &eventLoop->timeEventBuckets[id & eventLoop->timeEventBucketsMask];
+}
+
+/* Keep about one time event per bucket. */
+static int aeHashGrow(aeEventLoop *eventLoop) {
+    int oldsize = eventLoop->timeEventBucketsMask+1;
+    int size = oldsize ? oldsize*2 : 16;
+    aeTimeEvent **old = eventLoop->timeEventBuckets;
+    int j;
+
+    eventLoop->timeEventBuckets = zcalloc(sizeof(aeTimeEvent*)*size);
+    if (eventLoop->timeEventBuckets == NULL) {
+        eventLoop->timeEventBuckets = old;
+        return AE_ERR;
+    }
+    eventLoop->timeEventBucketsMask = size-1;
+    for (j = 0; j < oldsize; j++) {
+        aeTimeEvent *te = old[j];
+        while (te) {
+            aeTimeEvent *next = te->hashNext;
+            aeTimeEvent **slot = aeHashSlot(eventLoop, te->id);
+            te->hashNext = *slot;
+            *slot = te;
+            te = next;
+        }
+    }
+    zfree(old);
+    return AE_OK;
+}
+
+static aeTimeEvent *aeHashUnlink(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent **slot;
+
+    if (eventLoop->timeEventBuckets == NULL) return NULL;
+    slot = aeHashSlot(eventLoop, id);
+    while (*slot) {
+        aeTimeEvent *te = *slot;
+        if (te->id == id) {
+            *slot = te->hashNext;
+            te->hashNext = NULL;
+            return te;
+        }
+        slot = &te->hashNext;
+    }
+    return NULL;
+}
+
+long long aeCreateTimeEventNs(aeEventLoop *eventLoop, long long nanoseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
     long long id = eventLoop->timeEventNextId++;
-    aeTimeEvent *te;
+    aeTimeEvent *te, **slot;
 
+    if (eventLoop->timeEventCount > eventLoop->timeEventBucketsMask &&
+        aeHashGrow(eventLoop) == AE_ERR) return AE_ERR;
     te = zmalloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
     te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->when = eventLoop->now + nanoseconds;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
+    te->next = NULL;
+    if (aeHeapInsert(eventLoop, te) == AE_ERR) {
+        zfree(te);
+        return AE_ERR;
+    }
+    slot = aeHashSlot(eventLoop, id);
+    te->hashNext = *slot;
+    *slot = te;
     return id;
 }
 
+long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
+        aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc)
+{
+    return aeCreateTimeEventNs(eventLoop, milliseconds*1000000LL, proc,
+                               clientData, finalizerProc);
+}
+
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
+    aeTimeEvent *te = aeHashUnlink(eventLoop, id);
+
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+    if (te->heapIndex == -1) {
+        /* The event is being processed right now, or has been and is
+         * waiting to be reinserted: processTimeEvents will free it. */
+        te->id = AE_DELETED_EVENT_ID;
+        return AE_OK;
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    aeHeapRemove(eventLoop, te);
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
+    return AE_OK;
 }
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+/* Return the first timer to fire, or NULL if there are no timers.  This is
+ * used to know how long the poll can sleep without delaying any event. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timeEventCount ? eventLoop->timeEventHeap[0] : NULL;
 }
 
-/* Process time events */
+/* Process time events which are due at the time read for this iteration. */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te, *prev;
+    aeTimeEvent *te, *rescheduled = NULL;
     long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
+    long long now = eventLoop->now;
 
-    prev = NULL;
-    te = eventLoop->timeEventHead;
     maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
-
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
+    while (eventLoop->timeEventCount) {
+        int retval;
+
+        te = eventLoop->timeEventHeap[0];
+        if (te->when > now) break;
+        /* Don't process time events created by time events in this
+         * iteration.  They are due no earlier than now, so everything
+         * behind them in the heap is either newer or not yet due. */
+        if (te->id > maxId) break;
+
+        aeHeapRemove(eventLoop, te);
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        if (retval != AE_NOMORE && te->id != AE_DELETED_EVENT_ID) {
+            /* Re-insert after the loop, so that a timer which reschedules
+             * itself with no delay runs at most once per iteration. */
+            te->when = now + retval*1000000LL;
+            te->next = rescheduled;
+            rescheduled = te;
+        } else {
+            if (te->id != AE_DELETED_EVENT_ID) aeHashUnlink(eventLoop, te->id);
             if (te->finalizerProc)
                 te->finalizerProc(eventLoop, te->clientData);
             zfree(te);
-            te = next;
-            continue;
         }
-
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
-            }
+    }
+    while (rescheduled) {
+        te = rescheduled;
+        rescheduled = te->next;
+        te->next = NULL;
+        /* A later timer in this pass may have deleted it. */
+        if (te->id == AE_DELETED_EVENT_ID ||
+            aeHeapInsert(eventLoop, te) == AE_ERR) {
+            if (te->id != AE_DELETED_EVENT_ID) aeHashUnlink(eventLoop, te->id);
+            if (te->finalizerProc)
+                te->finalizerProc(eventLoop, te->clientData);
+            zfree(te);
         }
-        prev = te;
-        te = te->next;
     }
     return processed;
 }
@@ -357,6 +551,8 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
  * if flags has AE_TIME_EVENTS set, time events are processed.
  * if flags has AE_DONT_WAIT set the function returns ASAP until all
  * the events that's possible to process without to wait are processed.
+ * if flags has AE_CALL_BEFORE_SLEEP set, the beforesleep callback is called
+ * before working out how long to wait for.
  *
  * The function returns the number of events processed. */
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
@@ -366,6 +562,9 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
 
+    if (eventLoop->beforesleep != NULL && flags & AE_CALL_BEFORE_SLEEP)
+        eventLoop->beforesleep(eventLoop);
+
     /* Note that we want call select() even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
@@ -379,20 +578,18 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
-            aeGetTime(&now_sec, &now_ms);
             tvp = &tv;
 
-            /* How many milliseconds we need to wait for the next
-             * time event to fire? */
-            long long ms =
-                (shortest->when_sec - now_sec)*1000 +
-                shortest->when_ms - now_ms;
+            /* How long do we need to wait for the next time event to
+             * fire?  Measured against the time read for this iteration,
+             * which is also the base for any timers created since.
+             * Round up to whole microseconds so that we don't wake up
+             * just before the timer is due and spin. */
+            long long us = (shortest->when - eventLoop->now + 999)/1000;
 
-            if (ms > 0) {
-                tvp->tv_sec = ms/1000;
-                tvp->tv_usec = (ms % 1000)*1000;
+            if (us > 0) {
+                tvp->tv_sec = us/1000000;
+                tvp->tv_usec = us % 1000000;
             } else {
                 tvp->tv_sec = 0;
                 tvp->tv_usec = 0;
@@ -410,6 +607,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
         numevents = aeApiPoll(eventLoop, tvp);
+        aeUpdateTime(eventLoop);
         for (j = 0; j < numevents; j++) {
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
@@ -424,6 +622,9 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 				DEBUG_PRINT("fd=%d fe->mask=%d", fd, fe->mask);
                 rfired = 1;
                 fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+                /* The handler may have registered a new fd and so resized
+                 * the events table. */
+                fe = &eventLoop->events[fd];
             }
             if (fe->mask & mask & AE_WRITABLE) {
                 if (!rfired || fe->wfileProc != fe->rfileProc)
@@ -431,6 +632,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
             processed++;
         }
+    } else {
+        aeUpdateTime(eventLoop);
     }
     /* Check time events */
     if (flags & AE_TIME_EVENTS)
@@ -464,29 +667,46 @@ int aeWait(int fd, int mask, long long milliseconds) {
 void aeMain(aeEventLoop *eventLoop) {
     eventLoop->stop = 0;
     while (!eventLoop->stop) {
-        if (eventLoop->beforesleep != NULL)
-            eventLoop->beforesleep(eventLoop);
-        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS|AE_CALL_BEFORE_SLEEP);
     }
 }
 
+/* For embedding the loop in another event loop: returns an fd which is
+ * readable whenever aeProcessEvents(AE_DONT_WAIT) would find file events to
+ * process, or -1 if the backend has no such fd.  Call aeFlushEvents() after
+ * each aeProcessEvents(), before going back to waiting on it. */
+int aeGetPollFd(aeEventLoop *eventLoop) {
+    return aeApiPollFd(eventLoop);
+}
+
+/* Hand any changes that the backend has batched up to the kernel */
+void aeFlushEvents(aeEventLoop *eventLoop) {
+    aeApiFlush(eventLoop);
+}
+
+/* When the nearest time event is due, in CLOCK_MONOTONIC nanoseconds, or -1
+ * if there are none. */
+long long aeGetNextTimeEventNs(aeEventLoop *eventLoop) {
+    aeTimeEvent *te = aeSearchNearestTimer(eventLoop);
+
+    return te ? te->when : -1;
+}
+
 char *aeGetApiName(void) {
     return aeApiName();
 }
 
+char *aeGetEventLoopApiName(aeEventLoop *eventLoop) {
+#ifdef HAVE_IO_URING
+    if (eventLoop->api == AE_API_IO_URING) return "io_uring";
+#endif
+    return aeApiName();
+}
+
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
 
 int aeHasEvents(aeEventLoop *eventLoop) {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    int found_timed_event = 0;
-    while(te) {
-        if(te->id != AE_DELETED_EVENT_ID) {
-            found_timed_event = 1;
-            break;
-        }
-        te = te->next;
-    }
-    return found_timed_event || eventLoop->maxfd != -1;
+    return eventLoop->timeEventCount > 0 || eventLoop->maxfd != -1;
 }
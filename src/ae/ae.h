@@ -46,6 +46,11 @@
 #define AE_TIME_EVENTS 2
 #define AE_ALL_EVENTS (AE_FILE_EVENTS|AE_TIME_EVENTS)
 #define AE_DONT_WAIT 4
+#define AE_CALL_BEFORE_SLEEP 8
+
+/* Polling backends, for aeCreateEventLoopWithApi() */
+#define AE_API_DEFAULT 0
+#define AE_API_IO_URING 1
 
 #define AE_NOMORE -1
 #define AE_DELETED_EVENT_ID -1
@@ -72,12 +77,13 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* CLOCK_MONOTONIC, in nanoseconds */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
+    int heapIndex; /* position in timeEventHeap, -1 while being processed */
+    struct aeTimeEvent *hashNext; /* chain in timeEventBuckets */
+    struct aeTimeEvent *next; /* used while rescheduling */
 } aeTimeEvent;
 
 /* A fired event */
@@ -93,31 +99,48 @@ typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
+    long long now;       /* CLOCK_MONOTONIC in ns, read once per iteration */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEventHeap; /* Min-heap of time events by (when, id) */
+    int timeEventCount;
+    int timeEventCapacity;
+    aeTimeEvent **timeEventBuckets; /* Time events by id, for deletion */
+    int timeEventBucketsMask;
     int stop;
+    int api; /* AE_API_* backend in use */
     void *apidata; /* This is used for polling API specific data */
+    unsigned long long apiCtlCalls; /* changes handed to the backend, e.g. epoll_ctl() */
     aeBeforeSleepProc *beforesleep;
+    void *privdata; /* Free for use by the owner of the event loop */
 } aeEventLoop;
 
 /* Prototypes */
 aeEventLoop *aeCreateEventLoop(int setsize);
+aeEventLoop *aeCreateEventLoopWithApi(int setsize, int api);
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
 void aeStop(aeEventLoop *eventLoop);
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
+int aeSetFileEvents(aeEventLoop *eventLoop, int fd, int mask,
+        aeFileProc *proc, void *clientData);
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
+long long aeCreateTimeEventNs(aeEventLoop *eventLoop, long long nanoseconds,
+        aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
+char *aeGetEventLoopApiName(aeEventLoop *eventLoop);
+int aeGetPollFd(aeEventLoop *eventLoop);
+void aeFlushEvents(aeEventLoop *eventLoop);
+long long aeGetNextTimeEventNs(aeEventLoop *eventLoop);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
@@ -34,6 +34,7 @@
 typedef struct aeApiState {
     int epfd;
     struct epoll_event *events;
+    int nopwait2; /* set if the kernel turned out not to have epoll_pwait2 */
 } aeApiState;
 
 static int aeApiCreate(aeEventLoop *eventLoop) {
@@ -45,6 +46,7 @@ static int aeApiCreate(aeEventLoop *eventLoop) {
         zfree(state);
         return -1;
     }
+    state->nopwait2 = 0;
     state->epfd = epoll_create(1024); /* 1024 is just a hint for the kernel */
     if (state->epfd == -1) {
         zfree(state->events);
@@ -105,12 +107,55 @@ static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
     }
 }
 
+/* Replace the fd's events with mask in a single epoll_ctl() call */
+#define AE_API_HAS_SET_EVENT
+static int aeApiSetEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    struct epoll_event ee = {0}; /* avoid valgrind warning */
+    int oldmask = eventLoop->events[fd].mask;
+    int op;
+
+    if (oldmask == AE_NONE) op = EPOLL_CTL_ADD;
+    else if (mask == AE_NONE) op = EPOLL_CTL_DEL;
+    else op = EPOLL_CTL_MOD;
+    ee.events = 0;
+    if (mask & AE_READABLE) ee.events |= EPOLLIN;
+    if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+    if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
+    return 0;
+}
+
+/* epoll_pwait2 takes a timespec, so timers don't have to be rounded to the
+ * millisecond.  Without it the wait is rounded up rather than down, so that
+ * we don't wake up before the next timer is due. */
+static int aeApiWait(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+
+#ifdef HAVE_EPOLL_PWAIT2
+    if (!state->nopwait2) {
+        struct timespec ts;
+        int retval;
+
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+        }
+        retval = epoll_pwait2(state->epfd,state->events,eventLoop->setsize,
+                tvp ? &ts : NULL, NULL);
+        if (retval != -1 || errno != ENOSYS) return retval;
+        state->nopwait2 = 1;
+    }
+#endif
+    return epoll_wait(state->epfd,state->events,eventLoop->setsize,
+            tvp ? (int)(tvp->tv_sec*1000 + (tvp->tv_usec+999)/1000) : -1);
+}
+
 static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
     aeApiState *state = eventLoop->apidata;
     int retval, numevents = 0;
 
-    retval = epoll_wait(state->epfd,state->events,eventLoop->setsize,
-            tvp ? (tvp->tv_sec*1000 + tvp->tv_usec/1000) : -1);
+    retval = aeApiWait(eventLoop, tvp);
     if (retval > 0) {
         int j;
 
@@ -130,6 +175,16 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
     return numevents;
 }
 
+/* The epoll fd is itself readable while any watched fd is ready */
+#define AE_API_HAS_POLL_FD
+static int aeApiPollFd(aeEventLoop *eventLoop) {
+    return ((aeApiState *)eventLoop->apidata)->epfd;
+}
+
+static void aeApiFlush(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+}
+
 static char *aeApiName(void) {
     return "epoll";
 }
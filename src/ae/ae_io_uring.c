@@ -0,0 +1,483 @@
+/* Linux io_uring based ae.c module
+ *
+ * Readiness is watched with IORING_OP_POLL_ADD requests.  Registering,
+ * changing and removing interest only queue submission entries, and all of
+ * them are handed to the kernel by the io_uring_enter() call which also
+ * waits for completions, so a loop iteration costs one system call however
+ * many sockets were opened, closed or switched between reading and writing.
+ *
+ * ae promises level-triggered events: a handler may leave data unread and
+ * expects to be called again.  Multishot polls only post a completion when
+ * the socket is woken up, so they are edge-triggered, and the kernel rejects
+ * IORING_POLL_ADD_LEVEL together with IORING_POLL_ADD_MULTI.  Each poll is
+ * therefore one-shot and re-armed, in the next batch, after its handlers
+ * have run; a socket which is still ready completes again straight away.
+ *
+ * io_uring is only used when asked for with aeCreateEventLoopWithApi().  If
+ * the kernel doesn't have what we need (5.17 or later) the epoll module,
+ * which is compiled in alongside, is used instead. */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdatomic.h>
+
+/* The epoll module provides the fallback, under its own names. */
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiSetEvent aeEpollSetEvent
+#define aeApiWait aeEpollWait
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#define aeApiPollFd aeEpollPollFd
+#define aeApiFlush aeEpollFlush
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiSetEvent
+#undef aeApiWait
+#undef aeApiPoll
+#undef aeApiName
+#undef aeApiPollFd
+#undef aeApiFlush
+
+#define AE_URING_SQ_ENTRIES 1024
+#define AE_URING_CQ_ENTRIES 8192
+/* user_data of requests whose completions we don't care about */
+#define AE_URING_IGNORE UINT64_MAX
+#define AE_URING_REQUIRED_FEATURES \
+    (IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG|IORING_FEAT_CQE_SKIP)
+
+typedef struct aeUringFd {
+    unsigned gen;          /* completions of older poll requests are stale */
+    unsigned char armed;   /* a poll request for this fd is in flight */
+    unsigned char queued;  /* fd is on the re-arm list */
+} aeUringFd;
+
+typedef struct aeUringState {
+    int ringfd;
+    /* Submission queue */
+    unsigned *sqHead, *sqTail, *sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;  /* entries up to here are filled in */
+    struct io_uring_sqe *sqes;
+    /* Completion queue */
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    aeUringFd *fds;
+    int *rearm;            /* fds whose poll completed in the last batch */
+    int rearmCount;
+} aeUringState;
+
+static int aeUringSetup(struct io_uring_params *p) {
+    int ringfd;
+
+    memset(p,0,sizeof(*p));
+    p->flags = IORING_SETUP_CQSIZE|IORING_SETUP_COOP_TASKRUN;
+    p->cq_entries = AE_URING_CQ_ENTRIES;
+    ringfd = syscall(__NR_io_uring_setup,AE_URING_SQ_ENTRIES,p);
+    if (ringfd == -1 && errno == EINVAL) {
+        /* COOP_TASKRUN needs 5.19 */
+        memset(p,0,sizeof(*p));
+        p->flags = IORING_SETUP_CQSIZE;
+        p->cq_entries = AE_URING_CQ_ENTRIES;
+        ringfd = syscall(__NR_io_uring_setup,AE_URING_SQ_ENTRIES,p);
+    }
+    return ringfd;
+}
+
+static void aeUringUnmap(aeUringState *state) {
+    if (state->sqes != MAP_FAILED) munmap(state->sqes,state->sqesSize);
+    if (state->cqRing != MAP_FAILED && state->cqRing != state->sqRing)
+        munmap(state->cqRing,state->cqRingSize);
+    if (state->sqRing != MAP_FAILED) munmap(state->sqRing,state->sqRingSize);
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop) {
+    aeUringState *state;
+    struct io_uring_params p;
+    unsigned *sqArray;
+    unsigned i;
+    int j;
+
+    if ((state = zmalloc(sizeof(aeUringState))) == NULL) return -1;
+    state->fds = zmalloc(sizeof(aeUringFd)*eventLoop->setsize);
+    state->rearm = zmalloc(sizeof(int)*eventLoop->setsize);
+    state->sqRing = state->cqRing = state->sqes = MAP_FAILED;
+    state->ringfd = -1;
+    if (state->fds == NULL || state->rearm == NULL) goto err;
+    for (j = 0; j < eventLoop->setsize; j++) {
+        state->fds[j].gen = 0;
+        state->fds[j].armed = 0;
+        state->fds[j].queued = 0;
+    }
+    state->rearmCount = 0;
+
+    if ((state->ringfd = aeUringSetup(&p)) == -1) goto err;
+    if ((p.features & AE_URING_REQUIRED_FEATURES) != AE_URING_REQUIRED_FEATURES)
+        goto err;
+
+    state->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqRingSize > state->sqRingSize)
+            state->sqRingSize = state->cqRingSize;
+        state->cqRingSize = state->sqRingSize;
+    }
+    state->sqRing = mmap(NULL,state->sqRingSize,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQ_RING);
+    if (state->sqRing == MAP_FAILED) goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqRing = state->sqRing;
+    } else {
+        state->cqRing = mmap(NULL,state->cqRingSize,PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_CQ_RING);
+        if (state->cqRing == MAP_FAILED) goto err;
+    }
+    state->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqesSize,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) goto err;
+
+    state->sqHead = (unsigned *)((char *)state->sqRing + p.sq_off.head);
+    state->sqTail = (unsigned *)((char *)state->sqRing + p.sq_off.tail);
+    state->sqMask = (unsigned *)((char *)state->sqRing + p.sq_off.ring_mask);
+    state->sqEntries = p.sq_entries;
+    state->sqLocalTail = *state->sqTail;
+    /* Slot i of the ring always refers to entry i */
+    sqArray = (unsigned *)((char *)state->sqRing + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) sqArray[i] = i;
+    state->cqHead = (unsigned *)((char *)state->cqRing + p.cq_off.head);
+    state->cqTail = (unsigned *)((char *)state->cqRing + p.cq_off.tail);
+    state->cqMask = (unsigned *)((char *)state->cqRing + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->cqRing + p.cq_off.cqes);
+
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    aeUringUnmap(state);
+    if (state->ringfd != -1) close(state->ringfd);
+    zfree(state->fds);
+    zfree(state->rearm);
+    zfree(state);
+    return -1;
+}
+
+static int aeUringResize(aeEventLoop *eventLoop, int setsize) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *fds;
+    int *rearm;
+    int j;
+
+    if ((fds = zrealloc(state->fds,sizeof(aeUringFd)*setsize)) == NULL)
+        return -1;
+    state->fds = fds;
+    if ((rearm = zrealloc(state->rearm,sizeof(int)*setsize)) == NULL)
+        return -1;
+    state->rearm = rearm;
+    for (j = eventLoop->setsize; j < setsize; j++) {
+        state->fds[j].gen = 0;
+        state->fds[j].armed = 0;
+        state->fds[j].queued = 0;
+    }
+    return 0;
+}
+
+static void aeUringFree(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->apidata;
+
+    aeUringUnmap(state);
+    close(state->ringfd);
+    zfree(state->fds);
+    zfree(state->rearm);
+    zfree(state);
+}
+
+/* Hand every queued entry to the kernel, optionally waiting for at least one
+ * completion or until tvp has passed. */
+static int aeUringEnter(aeUringState *state, int wait, struct timeval *tvp) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {0};
+    unsigned flags = 0;
+    unsigned toSubmit;
+
+    atomic_store_explicit((_Atomic unsigned *)state->sqTail,state->sqLocalTail,
+            memory_order_release);
+    toSubmit = state->sqLocalTail -
+        atomic_load_explicit((_Atomic unsigned *)state->sqHead,memory_order_acquire);
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+        }
+    } else if (toSubmit == 0) {
+        return 0;
+    }
+    return syscall(__NR_io_uring_enter,state->ringfd,toSubmit,wait ? 1 : 0,
+            flags,wait ? &arg : NULL,wait ? sizeof(arg) : 0);
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeUringState *state) {
+    struct io_uring_sqe *sqe;
+
+    while (state->sqLocalTail - atomic_load_explicit(
+               (_Atomic unsigned *)state->sqHead,memory_order_acquire)
+           >= state->sqEntries) {
+        /* The batch is full, push it out early */
+        if (aeUringEnter(state,0,NULL) == -1 && errno != EINTR &&
+            errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "Error submitting to io_uring: %d", errno);
+            exit(1);
+        }
+    }
+    sqe = &state->sqes[state->sqLocalTail & *state->sqMask];
+    memset(sqe,0,sizeof(*sqe));
+    state->sqLocalTail++;
+    return sqe;
+}
+
+static unsigned aeUringPollEvents(int mask) {
+    unsigned events = 0;
+
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+    return events;
+}
+
+static unsigned long long aeUringToken(aeUringState *state, int fd) {
+    return ((unsigned long long)state->fds[fd].gen << 32) | (unsigned)fd;
+}
+
+static void aeUringQueuePoll(aeUringState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = aeUringPollEvents(mask);
+    sqe->user_data = aeUringToken(state,fd);
+    state->fds[fd].armed = 1;
+}
+
+/* Change the events of the in-flight poll request.  If it has completed
+ * already the update fails, and the re-arm picks up the new mask. */
+static void aeUringQueueUpdate(aeUringState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = -1;
+    sqe->addr = aeUringToken(state,fd);
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = aeUringPollEvents(mask);
+    sqe->user_data = AE_URING_IGNORE;
+}
+
+static void aeUringQueueRemove(aeUringState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = -1;
+    sqe->addr = aeUringToken(state,fd);
+    sqe->user_data = AE_URING_IGNORE;
+    state->fds[fd].armed = 0;
+    state->fds[fd].gen++;
+}
+
+static int aeUringAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeUringState *state = eventLoop->apidata;
+
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    if (state->fds[fd].armed)
+        aeUringQueueUpdate(state,fd,mask);
+    else
+        aeUringQueuePoll(state,fd,mask);
+    return 0;
+}
+
+static void aeUringDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeUringState *state = eventLoop->apidata;
+    int mask = eventLoop->events[fd].mask & (~delmask);
+
+    if (!state->fds[fd].armed) return;
+    if (mask != AE_NONE)
+        aeUringQueueUpdate(state,fd,mask);
+    else
+        aeUringQueueRemove(state,fd);
+}
+
+static int aeUringSetEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeUringState *state = eventLoop->apidata;
+
+    if (state->fds[fd].armed) {
+        if (mask != AE_NONE)
+            aeUringQueueUpdate(state,fd,mask);
+        else
+            aeUringQueueRemove(state,fd);
+    } else if (mask != AE_NONE) {
+        aeUringQueuePoll(state,fd,mask);
+    }
+    return 0;
+}
+
+/* Re-arm the polls which completed last time, now that their handlers
+ * have had the chance to drain them or delete them. */
+static void aeUringRearm(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->apidata;
+    int j;
+
+    for (j = 0; j < state->rearmCount; j++) {
+        int fd = state->rearm[j];
+        aeUringFd *ufd = &state->fds[fd];
+
+        ufd->queued = 0;
+        if (!ufd->armed && fd <= eventLoop->maxfd &&
+            eventLoop->events[fd].mask != AE_NONE)
+            aeUringQueuePoll(state,fd,eventLoop->events[fd].mask);
+    }
+    state->rearmCount = 0;
+}
+
+static int aeUringPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeUringState *state = eventLoop->apidata;
+    unsigned head, tail;
+    int wait, numevents = 0;
+
+    aeUringRearm(eventLoop);
+
+    /* Don't sleep if completions were left over from last time */
+    head = *state->cqHead;
+    tail = atomic_load_explicit((_Atomic unsigned *)state->cqTail,memory_order_acquire);
+    wait = head == tail && !(tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0);
+    if (aeUringEnter(state,wait,tvp) == -1 && errno != ETIME &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        fprintf(stderr, "Error entering io_uring: %d", errno);
+        exit(1);
+    }
+
+    tail = atomic_load_explicit((_Atomic unsigned *)state->cqTail,memory_order_acquire);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqMask];
+        unsigned long long ud = cqe->user_data;
+        int fd = (int)(ud & 0xffffffff);
+        int mask = 0;
+
+        head++;
+        if (ud == AE_URING_IGNORE || fd >= eventLoop->setsize ||
+            (unsigned)(ud >> 32) != state->fds[fd].gen)
+            continue;
+        state->fds[fd].armed = 0;
+        if (cqe->res < 0) {
+            /* Let the handlers find out what's wrong with the fd */
+            if (cqe->res != -EBADF) mask = eventLoop->events[fd].mask;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        }
+        if (mask == 0 && cqe->res == -EBADF) continue;
+        if (!state->fds[fd].queued) {
+            state->fds[fd].queued = 1;
+            state->rearm[state->rearmCount++] = fd;
+        }
+        if (mask) {
+            eventLoop->fired[numevents].fd = fd;
+            eventLoop->fired[numevents].mask = mask;
+            numevents++;
+        }
+    }
+    atomic_store_explicit((_Atomic unsigned *)state->cqHead,head,memory_order_release);
+    return numevents;
+}
+
+/* The ring fd is readable while there are completions to reap, but only
+ * polls which have been submitted can complete. */
+static void aeUringFlush(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->apidata;
+
+    aeUringRearm(eventLoop);
+    if (aeUringEnter(state,0,NULL) == -1 && errno != EINTR &&
+        errno != EAGAIN && errno != EBUSY) {
+        fprintf(stderr, "Error submitting to io_uring: %d", errno);
+        exit(1);
+    }
+}
+
+/* Dispatch between the two modules, according to which one the event loop
+ * ended up with. */
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    if (eventLoop->api == AE_API_IO_URING && aeUringCreate(eventLoop) == 0)
+        return 0;
+    eventLoop->api = AE_API_DEFAULT;
+    return aeEpollCreate(eventLoop);
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    if (eventLoop->api == AE_API_IO_URING)
+        return aeUringResize(eventLoop,setsize);
+    return aeEpollResize(eventLoop,setsize);
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    if (eventLoop->api == AE_API_IO_URING)
+        aeUringFree(eventLoop);
+    else
+        aeEpollFree(eventLoop);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    if (eventLoop->api == AE_API_IO_URING)
+        return aeUringAddEvent(eventLoop,fd,mask);
+    return aeEpollAddEvent(eventLoop,fd,mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    if (eventLoop->api == AE_API_IO_URING)
+        aeUringDelEvent(eventLoop,fd,delmask);
+    else
+        aeEpollDelEvent(eventLoop,fd,delmask);
+}
+
+static int aeApiSetEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    if (eventLoop->api == AE_API_IO_URING)
+        return aeUringSetEvent(eventLoop,fd,mask);
+    return aeEpollSetEvent(eventLoop,fd,mask);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    if (eventLoop->api == AE_API_IO_URING)
+        return aeUringPoll(eventLoop,tvp);
+    return aeEpollPoll(eventLoop,tvp);
+}
+
+static int aeApiPollFd(aeEventLoop *eventLoop) {
+    if (eventLoop->api == AE_API_IO_URING)
+        return ((aeUringState *)eventLoop->apidata)->ringfd;
+    return aeEpollPollFd(eventLoop);
+}
+
+static void aeApiFlush(aeEventLoop *eventLoop) {
+    if (eventLoop->api == AE_API_IO_URING)
+        aeUringFlush(eventLoop);
+    else
+        aeEpollFlush(eventLoop);
+}
+
+static char *aeApiName(void) {
+    return aeEpollName();
+}
@@ -1,4 +1,6 @@
 #include "acurl.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 /* Helper functions */
 
@@ -29,11 +31,12 @@ static void stop_eventloop(struct aeEventLoop *UNUSED(eventLoop),
        gracefully? */
 }
 
-static void cleanup_curl_pointer(struct aeEventLoop *UNUSED(eventLoop),
+static void cleanup_curl_pointer(struct aeEventLoop *eventLoop,
                                  int fd,
                                  void *UNUSED(clientData),
                                  int UNUSED(mask))
 {
+    EventLoop *loop = (EventLoop*)eventLoop->privdata;
     CleanupData data;
     while(true) {
         ssize_t b_read = read(fd, &data, sizeof(CleanupData));
@@ -43,15 +46,59 @@ static void cleanup_curl_pointer(struct aeEventLoop *UNUSED(eventLoop),
         }
         switch (data.type) {
         case CleanupEasy:
-            curl_easy_cleanup((CURL*)data.ptr);
-            break;
-        case CleanupShare:
             {
-                CURLSHcode cs = curl_share_cleanup((CURLSH*)data.ptr);
-                if (cs != 0) {
-                    fprintf(stderr, "Got bad code cleaning up shared %p: %d\n", data.ptr, cs);
-                }
+                AcHandlePool *handles;
+                curl_easy_getinfo((CURL*)data.ptr, CURLINFO_PRIVATE, (void **)&handles);
+                handle_pool_put(handles, (CURL*)data.ptr);
+                loop->stats.easy_handles_returned++;
             }
+            break;
+        case CleanupSession:
+            /* This comes after everything the session handed back, as the
+               session outlives its requests and responses */
+            handle_pool_free((AcHandlePool*)data.ptr);
+        }
+    }
+}
+
+static int retry_completed(struct aeEventLoop *UNUSED(eventLoop), long long UNUSED(id), void *clientData)
+{
+    EventLoop *loop = (EventLoop*)clientData;
+    while(loop->req_out_overflow_head != NULL) {
+        if(!ring_push(loop->completed, loop->req_out_overflow_head)) {
+            return COMPLETION_RETRY_MS;
+        }
+        loop->req_out_overflow_head = loop->req_out_overflow_head->next;
+    }
+    loop->req_out_overflow_tail = NULL;
+    loop->req_out_retry_timer_id = NO_ACTIVE_TIMER_ID;
+    return AE_NOMORE;
+}
+
+/* Hand a finished request back to the python thread.  If the completion ring
+   is full, which means python isn't keeping up, the request is parked and
+   retried from a timer; completions are never reordered. */
+void push_completed(EventLoop *loop, AcRequestData *rd)
+{
+    REQUEST_TRACE_PRINT("push_completed", rd);
+    if(likely(loop->req_out_overflow_head == NULL) && likely(ring_push(loop->completed, rd))) {
+        return;
+    }
+    DEBUG_PRINT("completion ring full; rd=%p", rd);
+    rd->next = NULL;
+    if(loop->req_out_overflow_tail != NULL) {
+        loop->req_out_overflow_tail->next = rd;
+    }
+    else {
+        loop->req_out_overflow_head = rd;
+    }
+    loop->req_out_overflow_tail = rd;
+    if(loop->req_out_retry_timer_id == NO_ACTIVE_TIMER_ID) {
+        loop->req_out_retry_timer_id = aeCreateTimeEvent(loop->event_loop, COMPLETION_RETRY_MS,
+                                                         retry_completed, loop, NULL);
+        if(loop->req_out_retry_timer_id == AE_ERR) {
+            fprintf(stderr, "push_completed failed to create timer\n");
+            exit(1);
         }
     }
 }
@@ -62,7 +109,6 @@ static void response_complete(EventLoop *loop)
     int remaining_in_queue = 1;
     AcRequestData *rd;
     CURLMsg *msg;
-    ssize_t ret;
     while(remaining_in_queue > 0)
     {
         DEBUG_PRINT("calling curl_multi_info_read",);
@@ -75,21 +121,30 @@ static void response_complete(EventLoop *loop)
         rd->result = msg->data.result;
         curl_slist_free_all(rd->headers);
         rd->headers = NULL;
-        free(rd->req_data_buf);
-        rd->req_data_buf = NULL;
-        rd->req_data_len = 0;
+        if(rd->body_mode == BodyCount) {
+            finish_body_checksum(rd);
+        }
+        if(rd->file != NULL) {
+            if(!file_sink_close(rd->file) && rd->result == CURLE_OK) {
+                rd->result = CURLE_WRITE_ERROR;
+            }
+            rd->file = NULL;
+        }
+
+        loop->stats.completed_requests++;
 
-        DEBUG_PRINT("writing to req_out_write",);
+        DEBUG_PRINT("pushing to req_out",);
         REQUEST_TRACE_PRINT("response_complete", rd);
-        ret = write(loop->req_out_write, &rd, sizeof(AcRequestData *));
-        if (ret < (ssize_t)sizeof(AcRequestData *)) {
-            fprintf(stderr, "Error writing to req_out_write");
-            exit(1);
+        if(rd->stream != NULL) {
+            stream_complete(loop, rd);
+        }
+        else {
+            push_completed(loop, rd);
         }
     }
 }
 
-static void socket_action_and_response_complete(EventLoop *loop, curl_socket_t socket, int ev_bitmask)
+void socket_action_and_response_complete(EventLoop *loop, curl_socket_t socket, int ev_bitmask)
 {
     DEBUG_PRINT("loop=%p socket=%d ev_bitmask=%d", loop, socket, ev_bitmask);
     int running_handles;
@@ -114,32 +169,54 @@ static void socket_event(struct aeEventLoop *eventLoop, int fd, void *clientData
     socket_action_and_response_complete((EventLoop*)clientData, (curl_socket_t)fd, ev_bitmask);
 }
 
+/* The events we have asked ae to watch for are kept with each socket, via
+   curl_multi_assign, so that curl repeating itself costs nothing and a
+   switch between reading and writing is a single change to the poll set. */
 static int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
 {
     EventLoop *loop = (EventLoop*)userp;
+    AcSocket *sock = (AcSocket*)socketp;
+    int mask = AE_NONE;
+    DEBUG_PRINT("socket=%d what=%d easy=%p", s, what, easy);
     switch(what) {
         case CURL_POLL_NONE:
-            DEBUG_PRINT("NONE socket=%d what=%d easy=%p", s, what, easy);
             // do nothing
-            break;
+            return 0;
         case CURL_POLL_IN:
-            DEBUG_PRINT("IN socket=%d what=%d easy=%p", s, what, easy);
-            aeCreateFileEvent(loop->event_loop, (int)s, AE_READABLE, socket_event, (void*)loop);
-            aeDeleteFileEvent(loop->event_loop, (int)s, AE_WRITABLE);
+            mask = AE_READABLE;
             break;
         case CURL_POLL_OUT:
-            DEBUG_PRINT("OUT socket=%d what=%d easy=%p", s, what, easy);
-            aeCreateFileEvent(loop->event_loop, (int)s, AE_WRITABLE, socket_event, (void*)loop);
-            aeDeleteFileEvent(loop->event_loop, (int)s, AE_READABLE);
+            mask = AE_WRITABLE;
             break;
         case CURL_POLL_INOUT:
-            DEBUG_PRINT("INOUT socket=%d what=%d easy=%p", s, what, easy);
-            aeCreateFileEvent(loop->event_loop, (int)s, AE_READABLE | AE_WRITABLE, socket_event, (void*)loop);
+            mask = AE_READABLE | AE_WRITABLE;
             break;
         case CURL_POLL_REMOVE:
-            DEBUG_PRINT("REMOVE socket=%d what=%d easy=%p", s, what, easy);
-            aeDeleteFileEvent(loop->event_loop, (int)s, AE_READABLE | AE_WRITABLE);
-            break;
+            if(sock != NULL) {
+                if(sock->mask != AE_NONE) {
+                    aeDeleteFileEvent(loop->event_loop, (int)s, sock->mask);
+                }
+                curl_multi_assign(loop->multi, s, NULL);
+                free(sock);
+            }
+            else {
+                aeDeleteFileEvent(loop->event_loop, (int)s, AE_READABLE | AE_WRITABLE);
+            }
+            return 0;
+    }
+    if(sock == NULL) {
+        sock = (AcSocket*)malloc(sizeof(AcSocket));
+        if(sock == NULL) {
+            /* Without somewhere to keep the state, let ae sort it out */
+            aeSetFileEvents(loop->event_loop, (int)s, mask, socket_event, (void*)loop);
+            return 0;
+        }
+        sock->mask = AE_NONE;
+        curl_multi_assign(loop->multi, s, sock);
+    }
+    if(sock->mask != mask &&
+       aeSetFileEvents(loop->event_loop, (int)s, mask, socket_event, (void*)loop) == AE_OK) {
+        sock->mask = mask;
     }
     return 0;
 }
@@ -152,88 +229,276 @@ static int timeout(struct aeEventLoop *UNUSED(eventLoop), long long UNUSED(id),
     return AE_NOMORE;
 }
 
-static int timer_callback(CURLM *UNUSED(multi), long timeout_ms, void *userp)
+static void set_timer(EventLoop *loop, long timeout_ms)
 {
-    DEBUG_PRINT("timeout_ms=%ld", timeout_ms);
-    EventLoop *loop = (EventLoop*)userp;
     if(loop->timer_id != NO_ACTIVE_TIMER_ID) {
         DEBUG_PRINT("DELETE timer_id=%ld", loop->timer_id);
         aeDeleteTimeEvent(loop->event_loop, loop->timer_id);
         loop->timer_id = NO_ACTIVE_TIMER_ID;
     }
-    if(timeout_ms >= 0) {
-        if((loop->timer_id = aeCreateTimeEvent(loop->event_loop, timeout_ms, timeout, userp, NULL)) == AE_ERR) {
+    loop->kick_pending = timeout_ms == 0;
+    if(timeout_ms > 0) {
+        if((loop->timer_id = aeCreateTimeEvent(loop->event_loop, timeout_ms, timeout, loop, NULL)) == AE_ERR) {
             /* TODO: handle gracefully? */
             fprintf(stderr, "timer_callback failed\n");
             exit(1);
         }
         DEBUG_PRINT("CREATE timer_id=%ld", loop->timer_id);
     }
+}
+
+static int timer_callback(CURLM *UNUSED(multi), long timeout_ms, void *userp)
+{
+    DEBUG_PRINT("timeout_ms=%ld", timeout_ms);
+    EventLoop *loop = (EventLoop*)userp;
+    if(loop->admitting) {
+        loop->timer_deferred = true;
+        loop->deferred_timeout_ms = timeout_ms;
+        return 0;
+    }
+    loop->timer_deferred = false;
+    set_timer(loop, timeout_ms);
+    return 0;
+}
+
+/* Curl only calls timer_callback when its next timeout changes, so if the
+   kick after a batch didn't produce a fresh value the last one it asked for
+   still has to be honoured. */
+void apply_deferred_timer(EventLoop *loop)
+{
+    if(loop->timer_deferred) {
+        loop->timer_deferred = false;
+        set_timer(loop, loop->deferred_timeout_ms);
+    }
+}
+
+/* Called before every poll.  A zero timeout from curl means "call
+   curl_multi_socket_action now", which can't be done from inside
+   timer_callback, so it is done here instead of arming a timer.  If curl
+   immediately asks for another one we fall back to a timer so that the
+   poll gets a turn in between. */
+static void before_sleep(struct aeEventLoop *eventLoop)
+{
+    EventLoop *loop = (EventLoop*)eventLoop->privdata;
+    if(loop->kick_pending) {
+        loop->kick_pending = false;
+        loop->stats.immediate_timeouts++;
+        socket_action_and_response_complete(loop, CURL_SOCKET_TIMEOUT, 0);
+        if(loop->kick_pending && loop->timer_id == NO_ACTIVE_TIMER_ID) {
+            loop->kick_pending = false;
+            if((loop->timer_id = aeCreateTimeEvent(loop->event_loop, 0, timeout, loop, NULL)) == AE_ERR) {
+                fprintf(stderr, "before_sleep failed to create timer\n");
+                exit(1);
+            }
+        }
+    }
+}
+
+
+/* Fill in a cpu_set_t from an iterable of CPU numbers */
+static int parse_cpu_set(PyObject *cpus, cpu_set_t *cpu_set)
+{
+    PyObject *iter = PyObject_GetIter(cpus);
+    PyObject *item;
+    if (iter == NULL) {
+        return -1;
+    }
+    CPU_ZERO(cpu_set);
+    while ((item = PyIter_Next(iter)) != NULL) {
+        long cpu = PyLong_AsLong(item);
+        Py_DECREF(item);
+        if (cpu == -1 && PyErr_Occurred()) {
+            break;
+        }
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            PyErr_Format(PyExc_ValueError, "CPU %ld is out of range", cpu);
+            break;
+        }
+        CPU_SET(cpu, cpu_set);
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+    if (CPU_COUNT(cpu_set) == 0) {
+        PyErr_SetString(PyExc_ValueError, "cpus must not be empty");
+        return -1;
+    }
+    return 0;
+}
+
+/* Apply the constructor's scheduling settings to the calling thread, which
+   is about to run the loop.  Settings which the system refuses, e.g.
+   SCHED_FIFO without CAP_SYS_NICE, only produce a warning. */
+static int apply_thread_settings(EventLoop *self)
+{
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    int err;
+    self->thread_id = tid;
+    if (self->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &self->cpus) != 0) {
+        if (PyErr_WarnFormat(PyExc_RuntimeWarning, 1, "Failed to set event loop CPU affinity: %s",
+                             strerror(errno)) != 0) {
+            return -1;
+        }
+    }
+    if (self->sched_fifo != 0) {
+        struct sched_param param = {.sched_priority = self->sched_fifo};
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0 && PyErr_WarnFormat(PyExc_RuntimeWarning, 1,
+                                         "Failed to set event loop to SCHED_FIFO: %s",
+                                         strerror(err)) != 0) {
+            return -1;
+        }
+    }
+    /* On Linux the nice value is per thread */
+    if (self->has_nice && setpriority(PRIO_PROCESS, tid, self->nice) != 0) {
+        if (PyErr_WarnFormat(PyExc_RuntimeWarning, 1, "Failed to set event loop nice value: %s",
+                             strerror(errno)) != 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
 
 /* Object functions */
 static PyObject *
-EventLoop_new(PyTypeObject *type, PyObject *UNUSED(args), PyObject *UNUSED(kwds))
+EventLoop_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    EventLoop *self = (EventLoop *)type->tp_alloc(type, 0);
+    EventLoop *self;
     int ret;
-    int req_in[2];
-    int req_out[2];
     int stop[2];
     int curl_easy_cleanup[2];
+    int max_admission_batch = DEFAULT_ADMISSION_BATCH;
+    const char *backend = NULL;
+    int api = AE_API_DEFAULT;
+    EventLoop *completions_to = NULL;
+    PyObject *cpus = Py_None;
+    int sched_fifo = 0;
+    PyObject *nice = Py_None;
+    int busy_poll_us = 0;
+    cpu_set_t cpu_set;
+    long nice_value = 0;
+
+    static char *kwlist[] = {"max_admission_batch", "backend", "completions_to",
+                             "cpus", "sched_fifo", "nice", "busy_poll_us", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|izO!OiOi", kwlist, &max_admission_batch, &backend,
+                                     &EventLoopType, &completions_to, &cpus, &sched_fifo, &nice,
+                                     &busy_poll_us)) {
+        return NULL;
+    }
+    if (busy_poll_us < 0) {
+        PyErr_SetString(PyExc_ValueError, "busy_poll_us must not be negative");
+        return NULL;
+    }
+    if (cpus != Py_None && parse_cpu_set(cpus, &cpu_set) != 0) {
+        return NULL;
+    }
+    if (sched_fifo != 0 && (sched_fifo < sched_get_priority_min(SCHED_FIFO) ||
+                            sched_fifo > sched_get_priority_max(SCHED_FIFO))) {
+        PyErr_Format(PyExc_ValueError, "sched_fifo must be a SCHED_FIFO priority (%d to %d)",
+                     sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+        return NULL;
+    }
+    if (nice != Py_None) {
+        nice_value = PyLong_AsLong(nice);
+        if (nice_value == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (nice_value < -20 || nice_value > 19) {
+            PyErr_SetString(PyExc_ValueError, "nice must be a nice value (-20 to 19)");
+            return NULL;
+        }
+    }
+    if (completions_to != NULL && completions_to->completion_loop != NULL) {
+        PyErr_SetString(PyExc_ValueError, "completions_to must own its completion ring");
+        return NULL;
+    }
+    if (max_admission_batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "max_admission_batch must be at least 1");
+        return NULL;
+    }
+    /* io_uring falls back to the default backend if the kernel can't do it */
+    if (backend != NULL) {
+        if (strcmp(backend, "io_uring") == 0) {
+            api = AE_API_IO_URING;
+        }
+        else if (strcmp(backend, aeGetApiName()) != 0) {
+            PyErr_Format(PyExc_ValueError, "unknown backend '%s'", backend);
+            return NULL;
+        }
+    }
+
+    self = (EventLoop *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->max_admission_batch = max_admission_batch;
+    self->has_cpus = cpus != Py_None;
+    if (self->has_cpus) {
+        self->cpus = cpu_set;
+    }
+    self->sched_fifo = sched_fifo;
+    self->has_nice = nice != Py_None;
+    self->nice = (int)nice_value;
+    self->busy_poll_ns = busy_poll_us * 1000LL;
+    pool_init(&self->request_pool, sizeof(AcRequestData), REQUEST_POOL_MAX_FREE);
+    pool_init(&self->buffer_pool, BUFFER_CHUNK_SIZE, BUFFER_POOL_MAX_FREE);
+    atomic_init(&self->resume, NULL);
     self->timer_id = NO_ACTIVE_TIMER_ID;
+    self->req_out_retry_timer_id = NO_ACTIVE_TIMER_ID;
     self->multi = curl_multi_init();
     curl_multi_setopt(self->multi, CURLMOPT_MAXCONNECTS, 1000); /* FIXME: magic number */
     curl_multi_setopt(self->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
     curl_multi_setopt(self->multi, CURLMOPT_SOCKETDATA, self);
     curl_multi_setopt(self->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
     curl_multi_setopt(self->multi, CURLMOPT_TIMERDATA, self);
-    if (self != NULL) {
-        self->event_loop = aeCreateEventLoop(200); /* FIXME: magic number */
-        ret = pipe(req_in);
-        if (ret != 0) {
-            fprintf(stderr, "Error opening req_in pipe: %d", ret);
-            /* TODO: throw a python exception for this instead of crashing */
-            exit(1);
-        }
-        self->req_in_read = req_in[0];
-        set_non_blocking(self->req_in_read);
-        self->req_in_write = req_in[1];
-        ret = pipe(req_out);
-        if (ret != 0) {
-            fprintf(stderr, "Error opening req_out pipe: %d", ret);
-            exit(1);
-        }
-        self->req_out_read = req_out[0];
-        set_non_blocking(self->req_out_read);
-        self->req_out_write = req_out[1];
-        ret = pipe(stop);
-        if (ret != 0) {
-            fprintf(stderr, "Error opening stop pipe: %d", ret);
-            exit(1);
-        }
-        self->stop_read = stop[0];
-        self->stop_write = stop[1];
-        ret = pipe(curl_easy_cleanup);
-        if (ret != 0) {
-            fprintf(stderr, "Error opening curl_easy_cleanup pipe: %d", ret);
-            exit(1);
-        }
-        self->curl_easy_cleanup_read = curl_easy_cleanup[0];
-        set_non_blocking(self->curl_easy_cleanup_read);
-        self->curl_easy_cleanup_write = curl_easy_cleanup[1];
-        if(aeCreateFileEvent(self->event_loop, self->req_in_read, AE_READABLE, start_request, self) == AE_ERR) {
-            /* TODO: handle gracefully */
-            exit(1);
-        }
-        if(aeCreateFileEvent(self->event_loop, self->stop_read, AE_READABLE, stop_eventloop, self) == AE_ERR) {
-            exit(1);
-        }
-        if(aeCreateFileEvent(self->event_loop, self->curl_easy_cleanup_read, AE_READABLE, cleanup_curl_pointer, NULL) == AE_ERR) {
+    self->event_loop = aeCreateEventLoopWithApi(INITIAL_SETSIZE, api);
+    self->event_loop->privdata = self;
+    aeSetBeforeSleepProc(self->event_loop, before_sleep);
+    if (ring_init(&self->req_in, REQUEST_QUEUE_SIZE) != 0) {
+        fprintf(stderr, "Error creating req_in ring: %d", errno);
+        /* TODO: throw a python exception for this instead of crashing */
+        exit(1);
+    }
+    /* A loop in a pool may push its completions onto another loop's ring
+       (it is multi-producer), so that python only has one fd to watch */
+    if (completions_to != NULL) {
+        Py_INCREF(completions_to);
+        self->completion_loop = completions_to;
+        self->completed = &completions_to->req_out;
+    }
+    else {
+        if (ring_init(&self->req_out, REQUEST_QUEUE_SIZE) != 0) {
+            fprintf(stderr, "Error creating req_out ring: %d", errno);
             exit(1);
         }
+        self->completed = &self->req_out;
+    }
+    ret = pipe(stop);
+    if (ret != 0) {
+        fprintf(stderr, "Error opening stop pipe: %d", ret);
+        exit(1);
+    }
+    self->stop_read = stop[0];
+    self->stop_write = stop[1];
+    ret = pipe(curl_easy_cleanup);
+    if (ret != 0) {
+        fprintf(stderr, "Error opening curl_easy_cleanup pipe: %d", ret);
+        exit(1);
+    }
+    self->curl_easy_cleanup_read = curl_easy_cleanup[0];
+    set_non_blocking(self->curl_easy_cleanup_read);
+    self->curl_easy_cleanup_write = curl_easy_cleanup[1];
+    if(aeCreateFileEvent(self->event_loop, self->req_in.fd, AE_READABLE, start_request, self) == AE_ERR) {
+        /* TODO: handle gracefully */
+        exit(1);
+    }
+    if(aeCreateFileEvent(self->event_loop, self->stop_read, AE_READABLE, stop_eventloop, self) == AE_ERR) {
+        exit(1);
+    }
+    if(aeCreateFileEvent(self->event_loop, self->curl_easy_cleanup_read, AE_READABLE, cleanup_curl_pointer, NULL) == AE_ERR) {
+        exit(1);
     }
     return (PyObject *)self;
 }
@@ -250,10 +515,15 @@ EventLoop_dealloc(EventLoop *self)
     */
     curl_multi_cleanup(self->multi);
     aeDeleteEventLoop(self->event_loop);
-    close(self->req_in_read);
-    close(self->req_in_write);
-    close(self->req_out_read);
-    close(self->req_out_write);
+    ring_free(&self->req_in);
+    if (self->completion_loop != NULL) {
+        Py_DECREF(self->completion_loop);
+    }
+    else {
+        ring_free(&self->req_out);
+    }
+    pool_free_all(&self->request_pool);
+    pool_free_all(&self->buffer_pool);
     close(self->stop_read);
     close(self->stop_write);
     close(self->curl_easy_cleanup_read);
@@ -262,30 +532,132 @@ EventLoop_dealloc(EventLoop *self)
 }
 
 
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static PyObject *
 EventLoop_once(EventLoop *self, PyObject *UNUSED(args))
 {
-    aeProcessEvents(self->event_loop, AE_ALL_EVENTS|AE_DONT_WAIT);
+    aeProcessEvents(self->event_loop, AE_ALL_EVENTS|AE_DONT_WAIT|AE_CALL_BEFORE_SLEEP);
+    aeFlushEvents(self->event_loop);
     Py_RETURN_NONE;
 }
 
 
+/* For driving the loop from another event loop with once(): an fd which is
+   readable when once() has sockets or requests to process */
+static PyObject *
+EventLoop_get_poll_fd(PyObject *self, PyObject *UNUSED(args))
+{
+    int fd = aeGetPollFd(((EventLoop*)self)->event_loop);
+    if (fd == -1) {
+        PyErr_SetString(PyExc_NotImplementedError, "the polling backend has no fd to wait on");
+        return NULL;
+    }
+    return PyLong_FromLong(fd);
+}
+
+
+/* When once() next has a timer to run, in time.monotonic() seconds, or None
+   if it has none */
+static PyObject *
+EventLoop_get_next_deadline(PyObject *self, PyObject *UNUSED(args))
+{
+    EventLoop *loop = (EventLoop*)self;
+    long long when;
+    if (loop->kick_pending) {
+        /* curl wants its zero timeout, which before_sleep delivers */
+        when = monotonic_ns();
+    }
+    else {
+        when = aeGetNextTimeEventNs(loop->event_loop);
+        if (when == -1) {
+            Py_RETURN_NONE;
+        }
+    }
+    return PyFloat_FromDouble(when / 1e9);
+}
+
+
+/* After any activity, keep polling without blocking for busy_poll_ns, so
+   that an event arriving soon after is picked up without paying for the
+   thread to be woken.  Only then does the loop go back to sleeping in the
+   poll.  ae records the time right after polling, which splits each
+   iteration into time spent polling and time spent handling events. */
+static void run_busy_poll(EventLoop *self)
+{
+    AcLoopStats *stats = &self->stats;
+    long long last_work = monotonic_ns();
+    long long start, end;
+    int processed;
+    do {
+        start = monotonic_ns();
+        if (start - last_work < self->busy_poll_ns) {
+            processed = aeProcessEvents(self->event_loop, AE_ALL_EVENTS|AE_CALL_BEFORE_SLEEP|AE_DONT_WAIT);
+            end = monotonic_ns();
+            stats->busy_poll_spins++;
+            if (processed > 0) {
+                stats->busy_poll_hits++;
+                stats->busy_poll_spin_ns += self->event_loop->now - start;
+                stats->busy_poll_work_ns += end - self->event_loop->now;
+                last_work = end;
+            }
+            else {
+                stats->busy_poll_spin_ns += end - start;
+            }
+        }
+        else {
+            processed = aeProcessEvents(self->event_loop, AE_ALL_EVENTS|AE_CALL_BEFORE_SLEEP);
+            end = monotonic_ns();
+            stats->busy_poll_blocks++;
+            if (processed > 0) {
+                stats->busy_poll_work_ns += end - self->event_loop->now;
+                last_work = end;
+            }
+        }
+    } while(!self->stop);
+}
+
 static PyObject *
 EventLoop_main(EventLoop *self, PyObject *UNUSED(args))
 {
     DEBUG_PRINT("Started",);
+    if (apply_thread_settings(self) != 0) {
+        return NULL;
+    }
     Py_BEGIN_ALLOW_THREADS
-    do {
-        DEBUG_PRINT("Start of aeProcessEvents",);
-        aeProcessEvents(self->event_loop, AE_ALL_EVENTS);
-        DEBUG_PRINT("End of aeProcessEvents",);
-    } while(!self->stop);
+    if (self->busy_poll_ns > 0) {
+        run_busy_poll(self);
+    }
+    else {
+        do {
+            DEBUG_PRINT("Start of aeProcessEvents",);
+            aeProcessEvents(self->event_loop, AE_ALL_EVENTS|AE_CALL_BEFORE_SLEEP);
+            DEBUG_PRINT("End of aeProcessEvents",);
+        } while(!self->stop);
+    }
     Py_END_ALLOW_THREADS
     DEBUG_PRINT("Ended",);
     Py_RETURN_NONE;
 }
 
 
+/* The kernel's id for the thread running main(), for profilers */
+static PyObject *
+EventLoop_get_thread_id(PyObject *self, PyObject *UNUSED(args))
+{
+    pid_t tid = ((EventLoop*)self)->thread_id;
+    if (tid == 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLong(tid);
+}
+
+
 static PyObject *
 EventLoop_stop(PyObject *self, PyObject *UNUSED(args))
 {
@@ -298,12 +670,55 @@ EventLoop_stop(PyObject *self, PyObject *UNUSED(args))
     Py_RETURN_NONE;
 }
 
-/* Get the out pipe */
+/* Get the eventfd which becomes readable when there are completions */
 
 static PyObject *
 Eventloop_get_out_fd(PyObject *self, PyObject *UNUSED(args))
 {
-    return PyLong_FromLong(((EventLoop*)self)->req_out_read);
+    return PyLong_FromLong(((EventLoop*)self)->completed->fd);
+}
+
+
+/* Take a completed request off the ring's hands and free it.  On success
+   *value is set to the new Response, otherwise to the error message.  The
+   caller gets the references to *future and *value. */
+static bool
+take_completed(AcRequestData *rd, PyObject **future, PyObject **value)
+{
+    bool ok = rd->result == CURLE_OK;
+    Session *session = rd->session;
+    if(rd->stream != NULL) {
+        return take_stream_event(rd, future, value);
+    }
+    REQUEST_TRACE_PRINT("take_completed", rd);
+    DEBUG_PRINT("read AcRequestData; address=%p", rd);
+    if(ok) {
+        Response *response = PyObject_New(Response, (PyTypeObject *)&ResponseType);
+        response->header = rd->header;
+        response->body = rd->body;
+        response->exports = 0;
+        response->body_mode = rd->body_mode;
+        response->body_checksum = rd->body_checksum;
+        response->stream = NULL;
+        response->curl = rd->curl;
+        response->session = rd->session;
+        *value = (PyObject*)response;
+    }
+    else {
+        *value = PyUnicode_FromString(curl_easy_strerror(rd->result));
+        free_header_buffer(session->loop, &rd->header);
+        free(rd->body.data);
+        schedule_cleanup_curl_easy(session, rd->curl);
+    }
+    *future = rd->future;
+    PyBuffer_Release(&rd->req_data);
+    Py_XDECREF(rd->cookies);
+    Py_XDECREF(rd->prepared);
+    pool_put(&session->loop->request_pool, rd);
+    if(!ok) {
+        Py_DECREF(session);
+    }
+    return ok;
 }
 
 
@@ -312,58 +727,149 @@ Eventloop_get_completed(PyObject *self, PyObject *UNUSED(args))
 {
     AcRequestData *rd;
     PyObject *list = PyList_New(0);
-    while(true) {
-        ssize_t b_read = read(((EventLoop*)self)->req_out_read, &rd, sizeof(AcRequestData *));
-        if (b_read == -1) {
-            break;
+    ring_clear_signal(((EventLoop*)self)->completed);
+    while((rd = (AcRequestData *)ring_pop(((EventLoop*)self)->completed)) != NULL) {
+        PyObject *tuple;
+        PyObject *future, *value;
+        bool ok = take_completed(rd, &future, &value);
+        if(future == NULL) {
+            continue;
         }
-        REQUEST_TRACE_PRINT("Eventloop_get_completed", rd);
-        DEBUG_PRINT("read AcRequestData; address=%p", rd);
-        PyObject *tuple = PyTuple_New(3);
-        if(rd->result == CURLE_OK) {
-            Response *response = PyObject_New(Response, (PyTypeObject *)&ResponseType);
-            response->header_buffer = rd->header_buffer_head;
-            response->body_buffer = rd->body_buffer_head;
-            response->curl = rd->curl;
-            response->session = rd->session;
-
+        tuple = PyTuple_New(3);
+        if(ok) {
             Py_INCREF(Py_None);
             PyTuple_SET_ITEM(tuple, 0, Py_None);
-            PyTuple_SET_ITEM(tuple, 1, (PyObject*)response);
-            PyTuple_SET_ITEM(tuple, 2, rd->future);
+            PyTuple_SET_ITEM(tuple, 1, value);
         }
         else {
-            PyObject* error = PyUnicode_FromString(curl_easy_strerror(rd->result));
-            free_buffer_nodes(rd->header_buffer_head);
-            free_buffer_nodes(rd->body_buffer_head);
-            curl_easy_cleanup(rd->curl);
-            Py_DECREF(rd->session);
-
-            PyTuple_SET_ITEM(tuple, 0, error);
+            PyTuple_SET_ITEM(tuple, 0, value);
             Py_INCREF(Py_None);
             PyTuple_SET_ITEM(tuple, 1, Py_None);
-            PyTuple_SET_ITEM(tuple, 2, rd->future);
         }
+        PyTuple_SET_ITEM(tuple, 2, future);
         PyList_Append(list, tuple);
         Py_DECREF(tuple);
-        if(rd->req_data_buf != NULL) {
-            /* TODO: this should never happen, it should have already been
-               freed somewhere */
-            free(rd->req_data_buf);
-        }
-        Py_XDECREF(rd->cookies);
-        free(rd);
     }
     return list;
 }
 
 
+/* Set the result of the future of every completed request, or an exception
+   of type error_class with curl's message.  Futures which are already done,
+   e.g. cancelled by a timeout, are skipped.  Every completion is consumed
+   even if a call fails; the first failure is raised at the end.  Returns
+   the number of futures resolved. */
+static PyObject *
+Eventloop_resolve_completed(PyObject *self, PyObject *error_class)
+{
+    AcRequestData *rd;
+    PyObject *exc_type = NULL, *exc_value = NULL, *exc_tb = NULL;
+    long resolved = 0;
+    ring_clear_signal(((EventLoop*)self)->completed);
+    while((rd = (AcRequestData *)ring_pop(((EventLoop*)self)->completed)) != NULL) {
+        PyObject *future, *value, *done, *ret = NULL;
+        bool ok = take_completed(rd, &future, &value);
+        bool failed;
+        if(future == NULL) {
+            /* A streamed response with nobody waiting */
+            continue;
+        }
+        done = PyObject_CallMethodObjArgs(future, str_done, NULL);
+        if(done == Py_False) {
+            if(ok) {
+                ret = PyObject_CallMethodObjArgs(future, str_set_result, value, NULL);
+            }
+            else {
+                PyObject *error = PyObject_CallFunctionObjArgs(error_class, value, NULL);
+                if(error != NULL) {
+                    ret = PyObject_CallMethodObjArgs(future, str_set_exception, error, NULL);
+                    Py_DECREF(error);
+                }
+            }
+            if(ret != NULL) {
+                resolved++;
+            }
+        }
+        failed = done == NULL || (done == Py_False && ret == NULL);
+        Py_XDECREF(ret);
+        Py_XDECREF(done);
+        if(failed) {
+            if(exc_type == NULL) {
+                PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+            }
+            PyErr_Clear();
+        }
+        Py_DECREF(value);
+        Py_DECREF(future);
+    }
+    if(exc_type != NULL) {
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+        return NULL;
+    }
+    return PyLong_FromLong(resolved);
+}
+
+
+static PyObject *
+EventLoop_get_stats(PyObject *self, PyObject *UNUSED(args))
+{
+    AcLoopStats *stats = &((EventLoop*)self)->stats;
+    PyObject *histogram = PyTuple_New(ADMISSION_HISTOGRAM_BUCKETS);
+    if (histogram == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < ADMISSION_HISTOGRAM_BUCKETS; i++) {
+        PyTuple_SET_ITEM(histogram, i, PyLong_FromUnsignedLongLong(stats->admission_histogram[i]));
+    }
+    AcPool *request_pool = &((EventLoop*)self)->request_pool;
+    AcPool *buffer_pool = &((EventLoop*)self)->buffer_pool;
+    unsigned long long ctl_calls = ((EventLoop*)self)->event_loop->apiCtlCalls;
+    return Py_BuildValue("{s:s,s:i,s:K,s:K,s:K,s:K,s:N,s:K,s:K,s:K,s:d,s:L,s:K,s:K,s:K,s:K,s:K,"
+                         "s:K,s:K,s:n,s:K,s:K,s:n,s:K,s:K,s:K,s:d}",
+                         "backend", aeGetEventLoopApiName(((EventLoop*)self)->event_loop),
+                         "fd_table_size", aeGetSetSize(((EventLoop*)self)->event_loop),
+                         "admission_batches", stats->admission_batches,
+                         "admission_requests", stats->admission_requests,
+                         "admission_max_batch", stats->admission_max_batch,
+                         "admission_capped", stats->admission_capped,
+                         "admission_histogram", histogram,
+                         "immediate_timeouts", stats->immediate_timeouts,
+                         "completed_requests", stats->completed_requests,
+                         "poll_ctl_calls", ctl_calls,
+                         "poll_ctl_per_request",
+                         stats->completed_requests ? (double)ctl_calls / stats->completed_requests : 0.0,
+                         "busy_poll_us", ((EventLoop*)self)->busy_poll_ns / 1000,
+                         "busy_poll_spins", stats->busy_poll_spins,
+                         "busy_poll_hits", stats->busy_poll_hits,
+                         "busy_poll_blocks", stats->busy_poll_blocks,
+                         "busy_poll_spin_ns", stats->busy_poll_spin_ns,
+                         "busy_poll_work_ns", stats->busy_poll_work_ns,
+                         "request_pool_hits", request_pool->hits,
+                         "request_pool_misses", request_pool->misses,
+                         "request_pool_high_water", (Py_ssize_t)request_pool->high_water,
+                         "buffer_pool_hits", buffer_pool->hits,
+                         "buffer_pool_misses", buffer_pool->misses,
+                         "buffer_pool_high_water", (Py_ssize_t)buffer_pool->high_water,
+                         "easy_handles_created", stats->easy_handles_created,
+                         "easy_handles_reused", stats->easy_handles_reused,
+                         "easy_handles_returned", stats->easy_handles_returned,
+                         "easy_handle_reuse_ratio",
+                         stats->easy_handles_reused ?
+                         (double)stats->easy_handles_reused / (stats->easy_handles_reused + stats->easy_handles_created) : 0.0);
+}
+
+
 static PyMethodDef EventLoop_methods[] = {
     {"main", (PyCFunction)EventLoop_main, METH_NOARGS, "Run the event loop"},
     {"once", (PyCFunction)EventLoop_once, METH_NOARGS, "Run the event loop once"},
     {"stop", EventLoop_stop, METH_NOARGS, "Stop the event loop"},
     {"get_out_fd", Eventloop_get_out_fd, METH_NOARGS, "Get the outbound file dscriptor"},
     {"get_completed", Eventloop_get_completed, METH_NOARGS, "Get the user_object, response and error"},
+    {"resolve_completed", Eventloop_resolve_completed, METH_O, "Resolve the futures of completed requests"},
+    {"get_stats", EventLoop_get_stats, METH_NOARGS, "Get a dict of event loop counters"},
+    {"get_poll_fd", EventLoop_get_poll_fd, METH_NOARGS, "Get an fd which is readable when once() has work"},
+    {"get_next_deadline", EventLoop_get_next_deadline, METH_NOARGS, "Get the time.monotonic() when once() next has a timer to run"},
+    {"get_thread_id", EventLoop_get_thread_id, METH_NOARGS, "Get the TID of the thread running main()"},
     {NULL, NULL, 0, NULL}
 };
 
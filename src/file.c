@@ -0,0 +1,127 @@
+#include "acurl.h"
+
+/* Response bodies written straight to a file by the event loop thread.
+ *
+ * The file is opened by the python thread, so that errors are raised from
+ * request(), and is then written and closed by the loop thread.  Once the
+ * headers are in, space for the Content-Length is reserved with fallocate,
+ * without changing the file's size, so that the body is laid out in one
+ * piece.  Filesystems which can't do that just skip it.
+ *
+ * With O_DIRECT, writes bypass the page cache but have to be aligned, so
+ * the body is gathered into an aligned batch which is written whenever it
+ * fills up.  The last batch is padded out to the alignment and the file
+ * truncated back to the body's length afterwards.  Filesystems without
+ * O_DIRECT, such as tmpfs, get ordinary writes. */
+
+/* Python thread.  Sets an exception and returns NULL on failure. */
+AcFileSink *file_sink_open(const char *path, bool direct)
+{
+    AcFileSink *file = (AcFileSink *)calloc(1, sizeof(AcFileSink));
+    if(file == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    file->fd = -1;
+    if(direct) {
+        file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+        if(file->fd != -1) {
+            if(posix_memalign((void **)&file->batch, FILE_DIRECT_ALIGN, FILE_DIRECT_BATCH_SIZE) != 0) {
+                close(file->fd);
+                free(file);
+                PyErr_NoMemory();
+                return NULL;
+            }
+            file->direct = true;
+        }
+        else if(errno != EINVAL) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            free(file);
+            return NULL;
+        }
+    }
+    if(file->fd == -1) {
+        file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if(file->fd == -1) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            free(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+/* Event loop thread */
+
+static bool write_all(AcFileSink *file, const char *data, size_t len)
+{
+    while(len > 0) {
+        ssize_t written = pwrite(file->fd, data, len, file->written);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= (size_t)written;
+        file->written += written;
+    }
+    return true;
+}
+
+size_t file_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    AcRequestData *rd = (AcRequestData *)userdata;
+    AcFileSink *file = rd->file;
+    size_t len = size * nmemb;
+    size_t offset = 0;
+    if(!file->preallocated) {
+        curl_off_t content_length = -1;
+        file->preallocated = true;
+        curl_easy_getinfo(rd->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        if(content_length > 0) {
+            fallocate(file->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)content_length);
+        }
+    }
+    if(!file->direct) {
+        /* Returning short makes curl fail the transfer */
+        return write_all(file, ptr, len) ? len : 0;
+    }
+    while(offset < len) {
+        size_t n = FILE_DIRECT_BATCH_SIZE - file->batch_len;
+        if(n > len - offset) {
+            n = len - offset;
+        }
+        memcpy(file->batch + file->batch_len, ptr + offset, n);
+        file->batch_len += n;
+        offset += n;
+        if(file->batch_len == FILE_DIRECT_BATCH_SIZE) {
+            if(!write_all(file, file->batch, FILE_DIRECT_BATCH_SIZE)) {
+                return 0;
+            }
+            file->batch_len = 0;
+        }
+    }
+    return len;
+}
+
+/* Flush anything left and close the file; from response_complete, or for
+   a request which never started.  Returns false if the body couldn't be
+   written out. */
+bool file_sink_close(AcFileSink *file)
+{
+    bool ok = true;
+    if(file->batch_len > 0) {
+        off_t length = file->written + (off_t)file->batch_len;
+        size_t padded = (file->batch_len + FILE_DIRECT_ALIGN - 1) & ~(size_t)(FILE_DIRECT_ALIGN - 1);
+        memset(file->batch + file->batch_len, 0, padded - file->batch_len);
+        ok = write_all(file, file->batch, padded) && ftruncate(file->fd, length) == 0;
+    }
+    if(close(file->fd) != 0) {
+        ok = false;
+    }
+    free(file->batch);
+    free(file);
+    return ok;
+}
@@ -0,0 +1,475 @@
+#include "acurl.h"
+
+/* JSON decoding straight from a response's body buffer into python objects,
+ * without making a bytes or str of the whole document first.  The input is
+ * UTF-8, as RFC 8259 requires.
+ *
+ * Strings are scanned eight bytes at a time while they are plain ASCII,
+ * which most JSON is; such strings are copied into their str without going
+ * through the UTF-8 decoder.  Object keys are memoised, as arrays of objects
+ * repeat the same keys over and over. */
+
+typedef struct {
+    const char *start;
+    const char *p;
+    const char *end;
+    PyObject *memo;
+} JsonParser;
+
+static PyObject *parse_value(JsonParser *j);
+
+static void *json_error(JsonParser *j, const char *message)
+{
+    PyErr_Format(PyExc_ValueError, "%s at position %zd", message, (Py_ssize_t)(j->p - j->start));
+    return NULL;
+}
+
+static inline void skip_whitespace(JsonParser *j)
+{
+    while(j->p < j->end && (*j->p == ' ' || *j->p == '\n' || *j->p == '\r' || *j->p == '\t')) {
+        j->p++;
+    }
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* Non-zero if any of the eight bytes is a quote, a backslash, a control
+   character or not ASCII */
+static inline uint64_t special_bytes(uint64_t v)
+{
+    uint64_t quote = v ^ (ONES * '"');
+    uint64_t backslash = v ^ (ONES * '\\');
+    return ((quote - ONES) & ~quote) | ((backslash - ONES) & ~backslash) | ((v - ONES * 0x20) & ~v) | v;
+}
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static long parse_hex4(JsonParser *j, const char *p)
+{
+    long value = 0;
+    if(j->end - p < 4) {
+        return -1;
+    }
+    for(int i = 0; i < 4; i++) {
+        int digit = hex_value(p[i]);
+        if(digit < 0) {
+            return -1;
+        }
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+/* Decode one character of UTF-8 as strictly as the "strict" codec: no
+   overlong forms, surrogates or code points past U+10FFFF.  Returns -1 if
+   it isn't valid, otherwise the code point, moving *s past it. */
+static long decode_utf8(const char **s, const char *e)
+{
+    const unsigned char *p = (const unsigned char *)*s;
+    long c;
+    int n;
+    if(p[0] < 0x80) {
+        *s += 1;
+        return p[0];
+    }
+    if(p[0] >= 0xc2 && p[0] <= 0xdf) {
+        c = p[0] & 0x1f;
+        n = 1;
+    }
+    else if((p[0] & 0xf0) == 0xe0) {
+        c = p[0] & 0x0f;
+        n = 2;
+    }
+    else if(p[0] >= 0xf0 && p[0] <= 0xf4) {
+        c = p[0] & 0x07;
+        n = 3;
+    }
+    else {
+        return -1;
+    }
+    if(e - *s <= n) {
+        return -1;
+    }
+    for(int i = 1; i <= n; i++) {
+        if((p[i] & 0xc0) != 0x80) {
+            return -1;
+        }
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+    if((n == 2 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) ||
+       (n == 3 && (c < 0x10000 || c > 0x10ffff))) {
+        return -1;
+    }
+    *s += n + 1;
+    return c;
+}
+
+/* Decode a string with escapes into code points, of which there are never
+   more than bytes of escaped text.  Lone surrogates from \uXXXX escapes are
+   kept, as python's json module does, but the text around the escapes is
+   held to strict UTF-8 like any other string. */
+static PyObject *unescape_string(JsonParser *j, const char *s, const char *e)
+{
+    Py_UCS4 *buffer = (Py_UCS4 *)PyMem_Malloc(sizeof(Py_UCS4) * ((size_t)(e - s) + 1));
+    Py_UCS4 *out = buffer;
+    const char *start = s;
+    PyObject *result;
+    if(buffer == NULL) {
+        return PyErr_NoMemory();
+    }
+    while(s < e) {
+        if(*s != '\\') {
+            long c = decode_utf8(&s, e);
+            if(c < 0) {
+                /* Have the codec raise the same error as for a string
+                   without escapes */
+                PyMem_Free(buffer);
+                result = PyUnicode_DecodeUTF8(start, e - start, "strict");
+                if(result != NULL) {
+                    Py_DECREF(result);
+                    j->p = s;
+                    return json_error(j, "Invalid UTF-8");
+                }
+                return NULL;
+            }
+            *out++ = (Py_UCS4)c;
+            continue;
+        }
+        s++;
+        switch(*s++) {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '/': *out++ = '/'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u': {
+            long c = parse_hex4(j, s);
+            if(c < 0) {
+                j->p = s;
+                PyMem_Free(buffer);
+                return json_error(j, "Invalid \\uXXXX escape");
+            }
+            s += 4;
+            if(c >= 0xd800 && c <= 0xdbff && e - s >= 6 && s[0] == '\\' && s[1] == 'u') {
+                long low = parse_hex4(j, s + 2);
+                if(low >= 0xdc00 && low <= 0xdfff) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                    s += 6;
+                }
+            }
+            *out++ = (Py_UCS4)c;
+            break;
+        }
+        default:
+            j->p = s - 1;
+            PyMem_Free(buffer);
+            return json_error(j, "Invalid escape");
+        }
+    }
+    result = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, buffer, out - buffer);
+    PyMem_Free(buffer);
+    return result;
+}
+
+static PyObject *parse_string(JsonParser *j)
+{
+    const char *s = ++j->p;
+    const char *p = s;
+    bool escaped = false, ascii = true;
+    PyObject *result;
+    while(true) {
+        while(j->end - p >= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            if(special_bytes(v) & HIGHS) {
+                break;
+            }
+            p += 8;
+        }
+        if(p >= j->end) {
+            j->p = s - 1;
+            return json_error(j, "Unterminated string");
+        }
+        unsigned char c = (unsigned char)*p;
+        if(c == '"') {
+            break;
+        }
+        if(c == '\\') {
+            escaped = true;
+            p += 2;
+        }
+        else if(c < 0x20) {
+            j->p = p;
+            return json_error(j, "Invalid control character");
+        }
+        else {
+            ascii &= c < 0x80;
+            p++;
+        }
+    }
+    j->p = p + 1;
+    if(escaped) {
+        return unescape_string(j, s, p);
+    }
+    if(ascii) {
+        result = PyUnicode_New(p - s, 127);
+        if(result != NULL) {
+            memcpy(PyUnicode_1BYTE_DATA(result), s, (size_t)(p - s));
+        }
+        return result;
+    }
+    return PyUnicode_DecodeUTF8(s, p - s, "strict");
+}
+
+static PyObject *parse_number(JsonParser *j)
+{
+    const char *s = j->p;
+    const char *p = s;
+    bool is_float = false;
+    char small[64];
+    char *text;
+    PyObject *result;
+    if(p < j->end && *p == '-') {
+        p++;
+    }
+    if(p < j->end && *p == '0') {
+        p++;
+    }
+    else if(p < j->end && *p >= '1' && *p <= '9') {
+        while(p < j->end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    else {
+        return json_error(j, "Expecting value");
+    }
+    if(p < j->end && *p == '.') {
+        is_float = true;
+        if(++p >= j->end || *p < '0' || *p > '9') {
+            j->p = p;
+            return json_error(j, "Invalid number");
+        }
+        while(p < j->end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if(p < j->end && (*p == 'e' || *p == 'E')) {
+        is_float = true;
+        if(++p < j->end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+        if(p >= j->end || *p < '0' || *p > '9') {
+            j->p = p;
+            return json_error(j, "Invalid number");
+        }
+        while(p < j->end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    j->p = p;
+    /* Up to 18 digits always fit in a long long */
+    if(!is_float && p - s <= 18) {
+        long long value = 0;
+        const char *d = *s == '-' ? s + 1 : s;
+        for(; d < p; d++) {
+            value = value * 10 + (*d - '0');
+        }
+        return PyLong_FromLongLong(*s == '-' ? -value : value);
+    }
+    /* The body isn't NUL terminated, so the number is copied out for the
+       parsers which need that */
+    text = (size_t)(p - s) < sizeof(small) ? small : (char *)PyMem_Malloc((size_t)(p - s) + 1);
+    if(text == NULL) {
+        return PyErr_NoMemory();
+    }
+    memcpy(text, s, (size_t)(p - s));
+    text[p - s] = '\0';
+    if(is_float) {
+        double value = PyOS_string_to_double(text, NULL, NULL);
+        result = value == -1.0 && PyErr_Occurred() ? NULL : PyFloat_FromDouble(value);
+    }
+    else {
+        result = PyLong_FromString(text, NULL, 10);
+    }
+    if(text != small) {
+        PyMem_Free(text);
+    }
+    return result;
+}
+
+static PyObject *parse_array(JsonParser *j)
+{
+    PyObject *list = PyList_New(0);
+    if(list == NULL) {
+        return NULL;
+    }
+    j->p++;
+    skip_whitespace(j);
+    if(j->p < j->end && *j->p == ']') {
+        j->p++;
+        return list;
+    }
+    while(true) {
+        PyObject *item = parse_value(j);
+        if(item == NULL || PyList_Append(list, item) != 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+        skip_whitespace(j);
+        if(j->p < j->end && *j->p == ',') {
+            j->p++;
+            continue;
+        }
+        if(j->p < j->end && *j->p == ']') {
+            j->p++;
+            return list;
+        }
+        Py_DECREF(list);
+        return json_error(j, "Expecting ',' delimiter");
+    }
+}
+
+static PyObject *parse_object(JsonParser *j)
+{
+    PyObject *dict = PyDict_New();
+    if(dict == NULL) {
+        return NULL;
+    }
+    j->p++;
+    skip_whitespace(j);
+    if(j->p < j->end && *j->p == '}') {
+        j->p++;
+        return dict;
+    }
+    while(true) {
+        PyObject *key, *memo_key, *value;
+        skip_whitespace(j);
+        if(j->p >= j->end || *j->p != '"') {
+            Py_DECREF(dict);
+            return json_error(j, "Expecting property name enclosed in double quotes");
+        }
+        key = parse_string(j);
+        if(key == NULL) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+        memo_key = PyDict_SetDefault(j->memo, key, key);
+        Py_XINCREF(memo_key);
+        Py_DECREF(key);
+        if(memo_key == NULL) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+        skip_whitespace(j);
+        if(j->p >= j->end || *j->p != ':') {
+            Py_DECREF(memo_key);
+            Py_DECREF(dict);
+            return json_error(j, "Expecting ':' delimiter");
+        }
+        j->p++;
+        value = parse_value(j);
+        if(value == NULL || PyDict_SetItem(dict, memo_key, value) != 0) {
+            Py_XDECREF(value);
+            Py_DECREF(memo_key);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(value);
+        Py_DECREF(memo_key);
+        skip_whitespace(j);
+        if(j->p < j->end && *j->p == ',') {
+            j->p++;
+            continue;
+        }
+        if(j->p < j->end && *j->p == '}') {
+            j->p++;
+            return dict;
+        }
+        Py_DECREF(dict);
+        return json_error(j, "Expecting ',' delimiter");
+    }
+}
+
+static PyObject *parse_literal(JsonParser *j, const char *literal, size_t len, PyObject *value)
+{
+    if((size_t)(j->end - j->p) < len || memcmp(j->p, literal, len) != 0) {
+        return json_error(j, "Expecting value");
+    }
+    j->p += len;
+    Py_INCREF(value);
+    return value;
+}
+
+static PyObject *parse_value(JsonParser *j)
+{
+    PyObject *result;
+    skip_whitespace(j);
+    if(j->p >= j->end) {
+        return json_error(j, "Expecting value");
+    }
+    switch(*j->p) {
+    case '"':
+        return parse_string(j);
+    case '{':
+    case '[':
+        if(Py_EnterRecursiveCall(" while decoding JSON")) {
+            return NULL;
+        }
+        result = *j->p == '{' ? parse_object(j) : parse_array(j);
+        Py_LeaveRecursiveCall();
+        return result;
+    case 't':
+        return parse_literal(j, "true", 4, Py_True);
+    case 'f':
+        return parse_literal(j, "false", 5, Py_False);
+    case 'n':
+        return parse_literal(j, "null", 4, Py_None);
+    default:
+        return parse_number(j);
+    }
+}
+
+PyObject *json_loads(const char *data, size_t len)
+{
+    JsonParser j;
+    PyObject *result;
+    j.start = data;
+    j.p = data;
+    j.end = data + len;
+    /* A byte order mark isn't allowed, but is easy to ignore */
+    if(len >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0) {
+        j.p += 3;
+    }
+    j.memo = PyDict_New();
+    if(j.memo == NULL) {
+        return NULL;
+    }
+    result = parse_value(&j);
+    Py_DECREF(j.memo);
+    if(result != NULL) {
+        skip_whitespace(&j);
+        if(j.p != j.end) {
+            Py_DECREF(result);
+            return json_error(&j, "Extra data");
+        }
+    }
+    return result;
+}
@@ -0,0 +1,97 @@
+#include "acurl.h"
+
+/* Freelist of fixed-size blocks.  Blocks are taken by a single thread, the
+ * pool's owner, from a private list, and given back by any thread onto a
+ * lock-free (Treiber) stack.  The owner only ever takes the whole stack at
+ * once, with an exchange, so there is no ABA problem.  When the private list
+ * runs dry the owner refills it from the stack, keeping at most max_free
+ * blocks and handing the rest back to malloc.
+ *
+ * A free block's first word is its link, so a chain of BufferNodes, whose
+ * next pointer comes first, can be given back in one go. */
+
+void pool_init(AcPool *pool, size_t item_size, size_t max_free)
+{
+    pool->item_size = item_size < sizeof(AcPoolItem) ? sizeof(AcPoolItem) : item_size;
+    pool->max_free = max_free;
+    pool->free = NULL;
+    atomic_init(&pool->returned, NULL);
+    atomic_init(&pool->in_use, 0);
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->high_water = 0;
+}
+
+static void free_chain(AcPoolItem *item)
+{
+    while(item != NULL) {
+        AcPoolItem *next = item->next;
+        free(item);
+        item = next;
+    }
+}
+
+/* Must only be called once nothing else can use the pool */
+void pool_free_all(AcPool *pool)
+{
+    free_chain(pool->free);
+    pool->free = NULL;
+    free_chain(atomic_exchange_explicit(&pool->returned, NULL, memory_order_acquire));
+}
+
+static void pool_refill(AcPool *pool)
+{
+    AcPoolItem *item = atomic_exchange_explicit(&pool->returned, NULL, memory_order_acquire);
+    size_t kept = 0;
+    pool->free = item;
+    while(item != NULL && ++kept < pool->max_free) {
+        item = item->next;
+    }
+    if(item != NULL) {
+        free_chain(item->next);
+        item->next = NULL;
+    }
+}
+
+/* Owner thread only.  Returns NULL if malloc fails. */
+void *pool_get(AcPool *pool)
+{
+    AcPoolItem *item = pool->free;
+    if(unlikely(item == NULL)) {
+        pool_refill(pool);
+        item = pool->free;
+    }
+    if(likely(item != NULL)) {
+        pool->free = item->next;
+        pool->hits++;
+    }
+    else {
+        item = (AcPoolItem *)malloc(pool->item_size);
+        if(item == NULL) {
+            return NULL;
+        }
+        pool->misses++;
+    }
+    size_t in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    if(in_use > pool->high_water) {
+        pool->high_water = in_use;
+    }
+    return item;
+}
+
+/* Give back the chain of count blocks from first to last, linked through
+   their first word.  May be called from any thread. */
+void pool_put_chain(AcPool *pool, void *first, void *last, size_t count)
+{
+    AcPoolItem *tail = (AcPoolItem *)last;
+    tail->next = atomic_load_explicit(&pool->returned, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&pool->returned, &tail->next, (AcPoolItem *)first,
+                                                 memory_order_release, memory_order_relaxed)) {
+    }
+    atomic_fetch_sub_explicit(&pool->in_use, count, memory_order_relaxed);
+}
+
+void pool_put(AcPool *pool, void *item)
+{
+    pool_put_chain(pool, item, item, 1);
+}
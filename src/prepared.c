@@ -0,0 +1,174 @@
+#include "acurl.h"
+
+/* Request templates.  Session.prepare() checks and converts the method,
+ * URL, headers, auth and client certificate once, building the header list
+ * curl is given, and send() then only has to fill in an AcRequestData with
+ * the template, an optional URL suffix and the body.  The loop thread takes
+ * everything else from the template as it sets up the easy handle. */
+
+PyObject *prepared_new(Session *session, PyObject *args, PyObject *kwds)
+{
+    char *method;
+    char *url;
+    PyObject *headers = Py_None;
+    PyObject *auth = Py_None;
+    PyObject *cert = Py_None;
+    const char *body_mode = NULL;
+    BodyMode mode;
+    PreparedRequest *self;
+
+    static char *kwlist[] = {"method", "url", "headers", "auth", "cert", "body_mode", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss|OOOz", kwlist,
+                                     &method, &url, &headers, &auth, &cert, &body_mode)) {
+        return NULL;
+    }
+    if (!parse_body_mode(body_mode, &mode)) {
+        return NULL;
+    }
+    self = PyObject_New(PreparedRequest, &PreparedRequestType);
+    if (self == NULL) {
+        return NULL;
+    }
+    Py_INCREF(session);
+    self->session = session;
+    self->method = strdup(method);
+    self->url = strdup(url);
+    self->url_len = strlen(url);
+    self->auth = NULL;
+    self->ca_cert = NULL;
+    self->ca_key = NULL;
+    self->headers = NULL;
+    self->body_mode = mode;
+    if (!build_header_list(headers, &self->headers) ||
+        !format_auth(auth, &self->auth) ||
+        !copy_cert(cert, &self->ca_cert, &self->ca_key)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static void
+PreparedRequest_dealloc(PreparedRequest *self)
+{
+    free(self->method);
+    free(self->url);
+    free(self->auth);
+    free(self->ca_cert);
+    free(self->ca_key);
+    curl_slist_free_all(self->headers);
+    Py_XDECREF(self->session);
+    PyObject_Del(self);
+}
+
+static PyObject *
+PreparedRequest_send(PreparedRequest *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *values[3];
+    PyObject *future;
+    const char *url_suffix = NULL;
+    PyObject *data;
+    Session *session = self->session;
+
+    static const char *const names[] = {"future", "url_suffix", "data"};
+    static PyObject *interned[3];
+
+    if (!parse_fastcall_args("send", names, interned, 3, 1, args, nargs, kwnames, values) ||
+        !parse_string_arg("send", "url_suffix", values[1], true, &url_suffix)) {
+        return NULL;
+    }
+    future = values[0];
+    data = values[2] != NULL ? values[2] : Py_None;
+    AcRequestData *rd = (AcRequestData *)pool_get(&session->loop->request_pool);
+    if(rd == NULL) {
+        return PyErr_NoMemory();
+    }
+    REQUEST_TRACE_PRINT("PreparedRequest_send", rd);
+    memset(rd, 0, sizeof(AcRequestData));
+    if(!get_request_body(data, &rd->req_data)) {
+        goto error_cleanup;
+    }
+    if(url_suffix != NULL) {
+        size_t suffix_len = strlen(url_suffix);
+        rd->url = (char *)malloc(self->url_len + suffix_len + 1);
+        if(rd->url == NULL) {
+            PyErr_NoMemory();
+            goto error_cleanup;
+        }
+        memcpy(rd->url, self->url, self->url_len);
+        memcpy(rd->url + self->url_len, url_suffix, suffix_len + 1);
+    }
+    Py_INCREF(self);
+    rd->prepared = self;
+    rd->body_mode = self->body_mode;
+    if(!queue_request(session, rd, future)) {
+        Py_DECREF(self);
+        goto error_cleanup;
+    }
+    Py_RETURN_NONE;
+
+    error_cleanup:
+    free(rd->url);
+    PyBuffer_Release(&rd->req_data);
+    pool_put(&session->loop->request_pool, rd);
+    return NULL;
+}
+
+
+static PyMethodDef PreparedRequest_methods[] = {
+    {"send", (PyCFunction)PreparedRequest_send, METH_FASTCALL | METH_KEYWORDS, "Send the request, resolving future with the Response"},
+    {NULL, NULL, 0, NULL}
+};
+
+
+PyTypeObject PreparedRequestType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "acurl.PreparedRequest",   /* tp_name */
+    sizeof(PreparedRequest),   /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)PreparedRequest_dealloc,   /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_reserved */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash  */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    "PreparedRequest Type",    /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    PreparedRequest_methods,   /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0,                         /* tp_del */
+    0,                         /* tp_version_tag */
+    0                          /* tp_finalize */
+};
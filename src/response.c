@@ -2,82 +2,306 @@
 
 /* Helper function */
 
-static BufferNode *alloc_buffer_node(size_t size, char *data) {
-    BufferNode *node = (BufferNode *)malloc(sizeof(BufferNode));
-    node->len = size;
-    node->buffer = strndup(data, size);
-    node->next = NULL;
-    return node;
+/* Make room for len more bytes of header text and fields more fields,
+   moving to a malloc'ed block twice the size if need be */
+static bool reserve_header(AcRequestData *rd, size_t len, size_t fields)
+{
+    HeaderBuffer *header = &rd->header;
+    size_t table = (header->count + fields) * sizeof(HeaderField);
+    size_t size = header->size;
+    char *data;
+    if(likely(header->len + len + table <= size)) {
+        return true;
+    }
+    if(size == 0) {
+        data = (char *)pool_get(&rd->session->loop->buffer_pool);
+        if(unlikely(data == NULL)) {
+            return false;
+        }
+        header->data = data;
+        header->size = BUFFER_CHUNK_SIZE;
+        header->pooled = true;
+        return reserve_header(rd, len, fields);
+    }
+    while(header->len + len + table > size) {
+        size *= 2;
+    }
+    /* Fields are kept aligned, as size stays a multiple of the chunk size */
+    if(size > UINT32_MAX || (data = (char *)malloc(size)) == NULL) {
+        return false;
+    }
+    memcpy(data, header->data, header->len);
+    table = header->count * sizeof(HeaderField);
+    memcpy(data + size - table, header->data + header->size - table, table);
+    free_header_buffer(rd->session->loop, header);
+    header->data = data;
+    header->size = size;
+    header->pooled = false;
+    return true;
+}
+
+/* Make room for at least needed bytes of body.  The first time round the
+   headers are in, so the body can be sized from its Content-Length; it may
+   still grow if the body is being decompressed. */
+static bool reserve_body(AcRequestData *rd, size_t needed)
+{
+    BodyBuffer *body = &rd->body;
+    size_t size = body->size;
+    char *data;
+    if(likely(needed <= size)) {
+        return true;
+    }
+    if(size == 0) {
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(rd->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        if(content_length > 0 && content_length <= MAX_BODY_PRESIZE) {
+            size = (size_t)content_length;
+        }
+        else {
+            size = INITIAL_BODY_SIZE;
+        }
+    }
+    while(size < needed) {
+        size *= 2;
+    }
+    data = (char *)realloc(body->data, size);
+    if(unlikely(data == NULL)) {
+        return false;
+    }
+    body->data = data;
+    body->size = size;
+    return true;
 }
 
 /* Async methods */
 
+/* Whether the headers collected are a final response's, rather than an
+   interim 1xx one's which another response follows */
+static bool final_status(HeaderBuffer *header)
+{
+    char *space = memchr(header->data, ' ', header->len);
+    return space != NULL && space + 1 < header->data + header->len && space[1] != '1';
+}
+
 static size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     AcRequestData *rd = (AcRequestData *)userdata;
-    BufferNode *node = alloc_buffer_node(size * nmemb, ptr);
-    if(unlikely(rd->header_buffer_head == NULL)) {
-        rd->header_buffer_head = node;
+    if(unlikely(rd->stream != NULL) && rd->stream->headers_done) {
+        /* Trailers.  The python thread may be reading the headers by now,
+           so they are dropped */
+        return size * nmemb;
+    }
+    size_t len = size * nmemb;
+    HeaderBuffer *header = &rd->header;
+    size_t colon, start, end;
+    if(len >= 5 && memcmp(ptr, "HTTP/", 5) == 0) {
+        header->len = 0;
+        header->count = 0;
+    }
+    if(unlikely(!reserve_header(rd, len, 1))) {
+        /* Returning short makes curl fail the transfer */
+        return 0;
+    }
+    memcpy(header->data + header->len, ptr, len);
+    /* Curl passes one whole line at a time.  Name: value, with the
+       whitespace around the value dropped.  Status, blank and folded lines
+       aren't fields. */
+    for(colon = 0; colon < len && ptr[colon] != ':'; colon++) {
+        if(ptr[colon] == ' ' || ptr[colon] == '\t' || ptr[colon] == '\r' || ptr[colon] == '\n') {
+            colon = len;
+            break;
+        }
+    }
+    if(colon > 0 && colon < len) {
+        HeaderField *field = HEADER_FIELD(header, header->count);
+        for(start = colon + 1; start < len && (ptr[start] == ' ' || ptr[start] == '\t'); start++);
+        for(end = len; end > start && (ptr[end - 1] == '\r' || ptr[end - 1] == '\n' ||
+                                       ptr[end - 1] == ' ' || ptr[end - 1] == '\t'); end--);
+        field->name = (uint32_t)header->len;
+        field->name_len = (uint32_t)colon;
+        field->value = (uint32_t)(header->len + start);
+        field->value_len = (uint32_t)(end - start);
+        header->count++;
     }
-    if(likely(rd->header_buffer_tail != NULL)) {
-        rd->header_buffer_tail->next = node;
+    header->len += len;
+    if(unlikely(rd->stream != NULL) && len > 0 && (ptr[0] == '\r' || ptr[0] == '\n') && final_status(header)) {
+        /* The blank line at the end of the headers.  Nothing may touch them
+           after this. */
+        stream_headers_complete(rd->session->loop, rd);
     }
-    rd->header_buffer_tail = node;
-    return node->len;
+    return len;
 }
 
 static size_t body_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     AcRequestData *rd = (AcRequestData *)userdata;
-    BufferNode *node = alloc_buffer_node(size * nmemb, ptr);
-    if(unlikely(rd->body_buffer_head == NULL)) {
-        rd->body_buffer_head = node;
+    size_t len = size * nmemb;
+    if(unlikely(!reserve_body(rd, rd->body.len + len))) {
+        /* Returning short makes curl fail the transfer */
+        return 0;
+    }
+    memcpy(rd->body.data + rd->body.len, ptr, len);
+    rd->body.len += len;
+    return len;
+}
+
+/* Bodies which aren't stored are still read, as the connection has to be
+   drained before it can be reused, but go no further */
+
+static size_t discard_callback(char *UNUSED(ptr), size_t size, size_t nmemb, void *UNUSED(userdata)) {
+    return size * nmemb;
+}
+
+/* The checksum is FNV-1a taken a 64 bit little-endian word at a time
+   rather than a byte at a time, as that is several times faster, with a
+   final partial word padded with zeros.  A partial word is carried over
+   between calls, so the result doesn't depend on how the body arrives. */
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static size_t checksum_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    AcRequestData *rd = (AcRequestData *)userdata;
+    size_t len = size * nmemb;
+    size_t i = 0;
+    uint64_t hash = rd->body_checksum;
+    uint64_t word = rd->checksum_word;
+    unsigned int fill = rd->checksum_word_len;
+    while(fill != 0 && i < len) {
+        word |= (uint64_t)(unsigned char)ptr[i++] << (8 * fill++);
+        if(fill == 8) {
+            hash = (hash ^ word) * FNV_PRIME;
+            word = 0;
+            fill = 0;
+        }
     }
-    if(likely(rd->body_buffer_tail != NULL)) {
-        rd->body_buffer_tail->next = node;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t next;
+        memcpy(&next, ptr + i, 8);
+        hash = (hash ^ le64toh(next)) * FNV_PRIME;
     }
-    rd->body_buffer_tail = node;
-    return node->len;
+    while(i < len) {
+        word |= (uint64_t)(unsigned char)ptr[i++] << (8 * fill++);
+    }
+    rd->body_checksum = hash;
+    rd->checksum_word = word;
+    rd->checksum_word_len = fill;
+    return len;
 }
 
-void start_request(struct aeEventLoop *UNUSED(eventLoop), int UNUSED(fd), void *clientData, int UNUSED(mask))
+void finish_body_checksum(AcRequestData *rd)
 {
-    AcRequestData *rd;
-    EventLoop *loop = (EventLoop*)clientData;
-    ssize_t b_read = read(loop->req_in_read, &rd, sizeof(AcRequestData *));
-    if (b_read < (ssize_t)sizeof(AcRequestData *)) {
-        fprintf(stderr, "Error reading from req_in_read");
-        exit(1);
+    if(rd->checksum_word_len != 0) {
+        rd->body_checksum = (rd->body_checksum ^ rd->checksum_word) * FNV_PRIME;
+        rd->checksum_word = 0;
+        rd->checksum_word_len = 0;
     }
+}
+
+/* Request bodies too big for POSTFIELDS.  The buffer is held by the
+   request until take_completed, so it can be read without the GIL. */
+static size_t read_callback(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    AcRequestData *rd = (AcRequestData *)userdata;
+    size_t left = (size_t)rd->req_data.len - rd->req_data_sent;
+    size_t len = size * nitems < left ? size * nitems : left;
+    memcpy(buffer, (const char *)rd->req_data.buf + rd->req_data_sent, len);
+    rd->req_data_sent += len;
+    return len;
+}
+
+/* For curl to send the body again, after a redirect or an auth challenge */
+static int seek_callback(void *userdata, curl_off_t offset, int origin)
+{
+    AcRequestData *rd = (AcRequestData *)userdata;
+    if(origin != SEEK_SET || offset < 0 || offset > (curl_off_t)rd->req_data.len) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    rd->req_data_sent = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+static void setup_request(EventLoop *loop, AcRequestData *rd)
+{
+    const char *method = rd->method;
+    const char *url = rd->url;
+    const char *auth = rd->auth;
+    const char *ca_cert = rd->ca_cert;
+    const char *ca_key = rd->ca_key;
+    struct curl_slist *headers = rd->headers;
     REQUEST_TRACE_PRINT("start_request", rd);
-    DEBUG_PRINT("read AcRequestData",);
-    rd->curl = curl_easy_init();
+    DEBUG_PRINT("popped AcRequestData",);
+    if(rd->prepared != NULL) {
+        /* The request holds on to its template until take_completed, so
+           curl can use its strings and header list without copies */
+        method = rd->prepared->method;
+        auth = rd->prepared->auth;
+        ca_cert = rd->prepared->ca_cert;
+        ca_key = rd->prepared->ca_key;
+        headers = rd->prepared->headers;
+        if(url == NULL) {
+            url = rd->prepared->url;
+        }
+    }
+    rd->curl = handle_pool_get(loop, rd->session);
     // MEMDEBUG_PRINT("init curl %p", rd->curl);
+    /* No CURLOPT_TIMEOUT or CURLOPT_LOW_SPEED_* here: curl applies them to
+       paused transfers too, and a streamed transfer which finished while on
+       the loop's resume stack would be freed by the python thread before
+       stream_resume_all got to it.  Streams would need to stay alive while
+       they are on the stack first. */
     curl_easy_setopt(rd->curl, CURLOPT_SHARE, rd->session->shared);
-    curl_easy_setopt(rd->curl, CURLOPT_URL, rd->url);
-    curl_easy_setopt(rd->curl, CURLOPT_CUSTOMREQUEST, rd->method);
+    curl_easy_setopt(rd->curl, CURLOPT_URL, url);
+    curl_easy_setopt(rd->curl, CURLOPT_CUSTOMREQUEST, method);
     //curl_easy_setopt(rd->curl, CURLOPT_VERBOSE, 1L); //DEBUG
     curl_easy_setopt(rd->curl, CURLOPT_ENCODING, "");
-    if(rd->headers != NULL) {
-        curl_easy_setopt(rd->curl, CURLOPT_HTTPHEADER, rd->headers);
+    if(headers != NULL) {
+        curl_easy_setopt(rd->curl, CURLOPT_HTTPHEADER, headers);
     }
-    if(rd->auth != NULL) {
-        curl_easy_setopt(rd->curl, CURLOPT_USERPWD, rd->auth);
+    if(auth != NULL) {
+        curl_easy_setopt(rd->curl, CURLOPT_USERPWD, auth);
     }
     for(int i=0; i < rd->cookies_len; i++) {
         DEBUG_PRINT("set cookie [%s]", rd->cookies_str[i]);
         curl_easy_setopt(rd->curl, CURLOPT_COOKIELIST, rd->cookies_str[i]);
     }
-    if(rd->req_data_buf != NULL) {
-        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDSIZE, rd->req_data_len);
-        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDS, rd->req_data_buf);
+    if(rd->req_data.obj != NULL) {
+        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)rd->req_data.len);
+        if(rd->req_data.len <= MAX_INLINE_REQUEST_BODY) {
+            curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDS, rd->req_data.buf);
+        }
+        else {
+            rd->req_data_sent = 0;
+            curl_easy_setopt(rd->curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(rd->curl, CURLOPT_READFUNCTION, read_callback);
+            curl_easy_setopt(rd->curl, CURLOPT_READDATA, rd);
+            curl_easy_setopt(rd->curl, CURLOPT_SEEKFUNCTION, seek_callback);
+            curl_easy_setopt(rd->curl, CURLOPT_SEEKDATA, rd);
+        }
     }
     curl_easy_setopt(rd->curl, CURLOPT_SSL_VERIFYPEER, 0L);
     curl_easy_setopt(rd->curl, CURLOPT_SSL_VERIFYHOST, 0L);
-    if ((rd->ca_key != NULL) && (rd->ca_cert != NULL)) {
-	curl_easy_setopt(rd->curl, CURLOPT_SSLKEY, rd->ca_key);
-        curl_easy_setopt(rd->curl, CURLOPT_SSLCERT, rd->ca_cert);
+    if ((ca_key != NULL) && (ca_cert != NULL)) {
+	curl_easy_setopt(rd->curl, CURLOPT_SSLKEY, ca_key);
+        curl_easy_setopt(rd->curl, CURLOPT_SSLCERT, ca_cert);
     }
     curl_easy_setopt(rd->curl, CURLOPT_PRIVATE, rd);
-    curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, body_callback);
+    switch(rd->body_mode) {
+    case BodyStore:
+        curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, body_callback);
+        break;
+    case BodyDiscard:
+        curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, discard_callback);
+        break;
+    case BodyCount:
+        rd->body_checksum = FNV_OFFSET_BASIS;
+        curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, checksum_callback);
+        break;
+    case BodyStream:
+        curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, stream_callback);
+        break;
+    case BodyFile:
+        curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, file_callback);
+        break;
+    }
     curl_easy_setopt(rd->curl, CURLOPT_WRITEDATA, rd);
     curl_easy_setopt(rd->curl, CURLOPT_HEADERFUNCTION, header_callback);
     curl_easy_setopt(rd->curl, CURLOPT_HEADERDATA, rd);
@@ -102,12 +326,12 @@ void start_request(struct aeEventLoop *UNUSED(eventLoop), int UNUSED(fd), void *
     if(rd->dummy) {
         rd->result = CURLE_OK;
         curl_slist_free_all(rd->headers);
-        free(rd->req_data_buf);
-        ssize_t ret = write(loop->req_out_write, &rd, sizeof(AcRequestData *));
-        if (ret < (ssize_t)sizeof(AcRequestData *)) {
-            fprintf(stderr, "Error writing dummy request to req_out_write");
-            exit(1);
+        rd->headers = NULL;
+        if(rd->file != NULL) {
+            file_sink_close(rd->file);
+            rd->file = NULL;
         }
+        push_completed(loop, rd);
     }
     else {
         DEBUG_PRINT("adding handle",);
@@ -115,13 +339,76 @@ void start_request(struct aeEventLoop *UNUSED(eventLoop), int UNUSED(fd), void *
     }
 }
 
+static void count_admission_batch(AcLoopStats *stats, int batch, bool capped)
+{
+    int bucket = 0;
+    stats->admission_batches++;
+    stats->admission_requests += (unsigned long long)batch;
+    if((unsigned long long)batch > stats->admission_max_batch) {
+        stats->admission_max_batch = (unsigned long long)batch;
+    }
+    if(capped) {
+        stats->admission_capped++;
+    }
+    while((batch >>= 1) != 0 && bucket < ADMISSION_HISTOGRAM_BUCKETS - 1) {
+        bucket++;
+    }
+    stats->admission_histogram[bucket]++;
+}
+
+/* Resume any paused streams whose readers have caught up, see stream.c.
+   Then admit every queued request, up to max_admission_batch, and give curl a
+   single kick to get them all going.  If the cap was hit the ring's eventfd
+   is made readable again so that the rest are picked up on the next pass
+   round the loop, after any pending socket events. */
+void start_request(struct aeEventLoop *UNUSED(eventLoop), int UNUSED(fd), void *clientData, int UNUSED(mask))
+{
+    AcRequestData *rd = NULL;
+    EventLoop *loop = (EventLoop*)clientData;
+    int batch = 0;
+    ring_clear_signal(&loop->req_in);
+    loop->admitting = true;
+    stream_resume_all(loop);
+    while(batch < loop->max_admission_batch &&
+          (rd = (AcRequestData *)ring_pop(&loop->req_in)) != NULL) {
+        setup_request(loop, rd);
+        batch++;
+    }
+    loop->admitting = false;
+    if(batch == loop->max_admission_batch) {
+        ring_wakeup(&loop->req_in);
+    }
+    if(batch == 0) {
+        apply_deferred_timer(loop);
+        return;
+    }
+    DEBUG_PRINT("admitted batch=%d", batch);
+    count_admission_batch(&loop->stats, batch, batch == loop->max_admission_batch);
+    if(loop->timer_deferred) {
+        socket_action_and_response_complete(loop, CURL_SOCKET_TIMEOUT, 0);
+        apply_deferred_timer(loop);
+    }
+}
+
 /* Object methods */
 
 static void Response_dealloc(Response *self)
 {
     DEBUG_PRINT("response=%p", self);
-    free_buffer_nodes(self->header_buffer);
-    free_buffer_nodes(self->body_buffer);
+    if(self->stream != NULL && !stream_release(self)) {
+        /* The transfer is still going, and is cleaned up when it ends */
+        free_header_buffer(self->session->loop, &self->header);
+        Py_XDECREF(self->session);
+        Py_TYPE(self)->tp_free((PyObject*)self);
+        return;
+    }
+    free_header_buffer(self->session->loop, &self->header);
+    /* Every view holds a reference to the response, so there can only be
+       exports left if something released a view it never got.  Leak the
+       body rather than free memory which may still be read. */
+    if(likely(self->exports == 0)) {
+        free(self->body.data);
+    }
     curl_multi_remove_handle(self->session->shared, self->curl);
     /* According to curl's docs, curl_easy_cleanup might call the
        HEADERFUNCTION.  This should't happen for HTTP, but we'll defensively
@@ -139,25 +426,13 @@ static void Response_dealloc(Response *self)
 
 /* Utility functions for getters */
 
-static PyObject * get_buffer_as_pylist(BufferNode *start)
+/* Header names and values, decoded as latin-1 as HTTP allows more than
+   ASCII there */
+static PyObject *header_pair(HeaderBuffer *header, HeaderField *field)
 {
-    int i = 0, len = 0;
-    PyObject* list;
-    BufferNode *node = start;
-    while(node != NULL)
-    {
-        len++;
-        node = node->next;
-    }
-    list = PyList_New(len);
-    node = start;
-    while(node != NULL)
-    {
-        PyList_SET_ITEM(list, i++, PyBytes_FromStringAndSize(node->buffer, node->len));
-        node = node->next;
-    }
-    DEBUG_PRINT("list=%p", list);
-    return list;
+    return Py_BuildValue("(NN)",
+                         PyUnicode_DecodeLatin1(header->data + field->name, field->name_len, NULL),
+                         PyUnicode_DecodeLatin1(header->data + field->value, field->value_len, NULL));
 }
 
 static PyObject *resp_get_info_long(Response *self, CURLINFO info)
@@ -191,14 +466,107 @@ static PyObject *resp_get_info_unicode(Response *self, CURLINFO info)
 static PyObject *
 Response_get_header(Response *self, PyObject *UNUSED(args))
 {
-    return get_buffer_as_pylist(self->header_buffer);
+    return PyBytes_FromStringAndSize(self->header.data, (Py_ssize_t)self->header.len);
+}
+
+static PyObject *
+Response_get_headers(Response *self, PyObject *UNUSED(args))
+{
+    HeaderBuffer *header = &self->header;
+    PyObject *tuple = PyTuple_New((Py_ssize_t)header->count);
+    if(tuple == NULL) {
+        return NULL;
+    }
+    for(size_t i = 0; i < header->count; i++) {
+        PyObject *pair = header_pair(header, HEADER_FIELD(header, i));
+        if(pair == NULL) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, (Py_ssize_t)i, pair);
+    }
+    return tuple;
+}
+
+/* {lowercased name: (name, value)}, the last field winning if a name is
+   repeated, for case-insensitive lookups */
+static PyObject *
+Response_get_header_map(Response *self, PyObject *UNUSED(args))
+{
+    HeaderBuffer *header = &self->header;
+    PyObject *map = PyDict_New();
+    char buffer[256];
+    if(map == NULL) {
+        return NULL;
+    }
+    for(size_t i = 0; i < header->count; i++) {
+        HeaderField *field = HEADER_FIELD(header, i);
+        /* Only ASCII is lowercased, as by Headers in python */
+        char *lower = field->name_len <= sizeof(buffer) ? buffer : (char *)malloc(field->name_len);
+        PyObject *key, *pair;
+        int ret;
+        if(lower == NULL) {
+            Py_DECREF(map);
+            return PyErr_NoMemory();
+        }
+        for(uint32_t j = 0; j < field->name_len; j++) {
+            lower[j] = Py_TOLOWER(header->data[field->name + j]);
+        }
+        key = PyUnicode_DecodeLatin1(lower, field->name_len, NULL);
+        if(lower != buffer) {
+            free(lower);
+        }
+        pair = key != NULL ? header_pair(header, field) : NULL;
+        ret = pair != NULL ? PyDict_SetItem(map, key, pair) : -1;
+        Py_XDECREF(key);
+        Py_XDECREF(pair);
+        if(ret != 0) {
+            Py_DECREF(map);
+            return NULL;
+        }
+    }
+    return map;
 }
 
 
 static PyObject *
 Response_get_body(Response *self, PyObject *UNUSED(args))
 {
-    return get_buffer_as_pylist(self->body_buffer);
+    return PyBytes_FromStringAndSize(self->body.data, (Py_ssize_t)self->body.len);
+}
+
+static PyObject *
+Response_get_json(Response *self, PyObject *UNUSED(args))
+{
+    return json_loads(self->body.data, self->body.len);
+}
+
+static PyObject *
+Response_get_body_checksum(Response *self, PyObject *UNUSED(args))
+{
+    if(self->body_mode != BodyCount) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromUnsignedLongLong(self->body_checksum);
+}
+
+static PyObject *
+Response_read_stream(Response *self, PyObject *waiter)
+{
+    if(self->stream == NULL) {
+        PyErr_SetString(PyExc_ValueError, "the response isn't being streamed");
+        return NULL;
+    }
+    return stream_read(self, waiter);
+}
+
+static PyObject *
+Response_get_stream_error(Response *self, PyObject *UNUSED(args))
+{
+    if(self->stream == NULL || !self->stream->finished || self->stream->result == CURLE_OK) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(curl_easy_strerror(self->stream->result));
 }
 
 static PyObject *Response_get_effective_url(Response *self, PyObject *UNUSED(args))
@@ -284,6 +652,29 @@ static PyObject *Response_get_redirect_url(Response *self, PyObject *UNUSED(args
     return resp_get_info_unicode(self, CURLINFO_REDIRECT_URL);
 }
 
+/* Buffer protocol: a read-only view of the body, with no copy */
+
+static int Response_getbuffer(Response *self, Py_buffer *view, int flags)
+{
+    /* An empty body has no storage, but views shouldn't get a NULL buf */
+    void *data = self->body.data != NULL ? self->body.data : (void *)"";
+    if(PyBuffer_FillInfo(view, (PyObject *)self, data, (Py_ssize_t)self->body.len, 1, flags) != 0) {
+        return -1;
+    }
+    self->exports++;
+    return 0;
+}
+
+static void Response_releasebuffer(Response *self, Py_buffer *UNUSED(view))
+{
+    self->exports--;
+}
+
+static PyBufferProcs Response_as_buffer = {
+    (getbufferproc)Response_getbuffer,
+    (releasebufferproc)Response_releasebuffer,
+};
+
 /* Type definition */
 
 static PyMethodDef Response_methods[] = {
@@ -302,7 +693,13 @@ static PyMethodDef Response_methods[] = {
     {"get_cookielist", (PyCFunction)Response_get_cookielist, METH_NOARGS, ""},
     {"get_redirect_url", (PyCFunction)Response_get_redirect_url, METH_NOARGS, "Get the redirect URL or None"},
     {"get_header", (PyCFunction)Response_get_header, METH_NOARGS, "Get the header"},
+    {"get_headers", (PyCFunction)Response_get_headers, METH_NOARGS, "Get a tuple of the header fields as (name, value)"},
+    {"get_header_map", (PyCFunction)Response_get_header_map, METH_NOARGS, "Get a dict of the header fields as lowercased name: (name, value)"},
     {"get_body", (PyCFunction)Response_get_body, METH_NOARGS, "Get the body"},
+    {"read_stream", (PyCFunction)Response_read_stream, METH_O, "Read what has arrived of a streamed body, b'' after saving the future to resolve when there is more, or None at the end"},
+    {"get_stream_error", (PyCFunction)Response_get_stream_error, METH_NOARGS, "Get the error which ended a streamed body, or None"},
+    {"get_json", (PyCFunction)Response_get_json, METH_NOARGS, "Decode the body, which must be UTF-8, as JSON"},
+    {"get_body_checksum", (PyCFunction)Response_get_body_checksum, METH_NOARGS, "Get the checksum of the body with body_mode 'count', otherwise None"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -331,7 +728,7 @@ PyTypeObject ResponseType = {
     0,                         /* tp_str */
     0,                         /* tp_getattro */
     0,                         /* tp_setattro */
-    0,                         /* tp_as_buffer */
+    &Response_as_buffer,       /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT,        /* tp_flags */
     "Response Type",           /* tp_doc */
     0,                         /* tp_traverse */
@@ -0,0 +1,171 @@
+#include "acurl.h"
+#include <sys/eventfd.h>
+#include <sched.h>
+
+/* Bounded multi-producer/single-consumer queue of pointers, based on Dmitry
+ * Vyukov's bounded MPMC queue.  Every cell carries a sequence number which
+ * tells producers whether the cell is free on the current lap around the
+ * ring, and tells the consumer whether it has been filled.  Only one thread
+ * may pop from a given ring.
+ *
+ * Each ring owns an eventfd.  It is written only when the number of pending
+ * items goes from zero to one, so a burst of pushes costs a single write()
+ * and the consumer only needs to drain the ring each time the fd becomes
+ * readable. */
+
+static void ring_signal(AcRing *ring)
+{
+    uint64_t one = 1;
+    ssize_t ret = write(ring->fd, &one, sizeof(one));
+    if (ret < (ssize_t)sizeof(one) && errno != EAGAIN) {
+        fprintf(stderr, "Error writing to ring eventfd: %d", errno);
+        exit(1);
+    }
+}
+
+int ring_init(AcRing *ring, size_t size)
+{
+    size_t capacity = 1;
+    while(capacity < size) {
+        capacity <<= 1;
+    }
+    ring->cells = (AcRingCell *)malloc(sizeof(AcRingCell) * capacity);
+    if(ring->cells == NULL) {
+        return -1;
+    }
+    for(size_t i = 0; i < capacity; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+        ring->cells[i].data = NULL;
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    ring->tail = 0;
+    atomic_init(&ring->pending, 0);
+    ring->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ring->fd == -1) {
+        free(ring->cells);
+        ring->cells = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void ring_free(AcRing *ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+    close(ring->fd);
+}
+
+/* Returns false, without blocking, if the ring is full. */
+bool ring_push(AcRing *ring, void *data)
+{
+    AcRingCell *cell;
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while(true) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if(diff < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    cell->data = data;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    if(atomic_fetch_add_explicit(&ring->pending, 1, memory_order_acq_rel) == 0) {
+        ring_signal(ring);
+    }
+    return true;
+}
+
+/* Push count items at once, or none of them if they don't all fit.  The
+ * cells are claimed together, so the consumer sees the items in order and
+ * back to back, and the eventfd is written at most once. */
+bool ring_push_many(AcRing *ring, void **items, size_t count)
+{
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(count == 0) {
+        return true;
+    }
+    if(count > ring->mask + 1) {
+        return false;
+    }
+    while(true) {
+        /* Cells are freed in order, so if the last one is free on this lap
+           the rest are too */
+        AcRingCell *last = &ring->cells[(pos + count - 1) & ring->mask];
+        size_t seq = atomic_load_explicit(&last->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + count - 1);
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + count,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if(diff < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    for(size_t i = 0; i < count; i++) {
+        AcRingCell *cell = &ring->cells[(pos + i) & ring->mask];
+        cell->data = items[i];
+        atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+    }
+    if(atomic_fetch_add_explicit(&ring->pending, (long)count, memory_order_acq_rel) == 0) {
+        ring_signal(ring);
+    }
+    return true;
+}
+
+/* Returns NULL once every claimed cell has been consumed.  If a producer has
+ * claimed the next cell but not yet filled it we wait for it, otherwise its
+ * push could be left in the ring with nobody due to be woken up for it. */
+void *ring_pop(AcRing *ring)
+{
+    AcRingCell *cell = &ring->cells[ring->tail & ring->mask];
+    size_t seq;
+    while((seq = atomic_load_explicit(&cell->seq, memory_order_acquire)) != ring->tail + 1) {
+        if(atomic_load_explicit(&ring->head, memory_order_relaxed) == ring->tail) {
+            return NULL;
+        }
+        sched_yield();
+    }
+    void *data = cell->data;
+    atomic_store_explicit(&cell->seq, ring->tail + ring->mask + 1, memory_order_release);
+    ring->tail++;
+    atomic_fetch_sub_explicit(&ring->pending, 1, memory_order_acq_rel);
+    return data;
+}
+
+/* Reset the eventfd.  This must be called before draining the ring, so that
+ * a push which races with the drain leaves the fd readable. */
+void ring_clear_signal(AcRing *ring)
+{
+    uint64_t value;
+    ssize_t ret = read(ring->fd, &value, sizeof(value));
+    if (ret == -1 && errno != EAGAIN) {
+        fprintf(stderr, "Error reading from ring eventfd: %d", errno);
+        exit(1);
+    }
+}
+
+/* Make the eventfd readable again, for a consumer which stopped draining
+ * before the ring was empty. */
+void ring_wakeup(AcRing *ring)
+{
+    ring_signal(ring);
+}
@@ -5,20 +5,35 @@ Session_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     Session *self;
     EventLoop *loop;
+    Py_ssize_t max_handles = DEFAULT_HANDLE_POOL_SIZE;
+    AcHandlePool *handles;
 
-    static char *kwlist[] = {"loop", NULL};
-    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &loop)) {
+    static char *kwlist[] = {"loop", "max_handles", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist, &loop, &max_handles)) {
         return NULL;
     }
+    if (max_handles < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_handles should be at least 0");
+        return NULL;
+    }
+    handles = (AcHandlePool *)calloc(1, sizeof(AcHandlePool));
+    if (handles == NULL || (max_handles > 0 &&
+                            (handles->handles = (CURL **)calloc((size_t)max_handles, sizeof(CURL *))) == NULL)) {
+        free(handles);
+        return PyErr_NoMemory();
+    }
+    handles->max = (size_t)max_handles;
 
     self = (Session *)type->tp_alloc(type, 0);
     if (self == NULL) {
+        handle_pool_free(handles);
         return NULL;
     }
 
     Py_INCREF(loop);
     self->loop = loop;
-    self->shared = curl_share_init();
+    self->handles = handles;
+    self->shared = handles->shared = curl_share_init();
     curl_share_setopt(self->shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
     curl_share_setopt(self->shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
     curl_share_setopt(self->shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
@@ -30,85 +45,250 @@ static void
 Session_dealloc(Session *self)
 {
     DEBUG_PRINT("response=%p", self);
-    schedule_cleanup_curl_share(self, self->shared);
+    schedule_cleanup_session(self);
     Py_XDECREF(self->loop);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
 
-static PyObject *
-Session_request(Session *self, PyObject *args, PyObject *kwds)
-{
-    char *method;
-    char *url;
-    PyObject *future;
-    PyObject *headers;
-    PyObject *auth;
-    PyObject *cert;
-    PyObject *cookies;
-    int req_data_len = 0;
-    char *req_data_buf = NULL;
-    int dummy;
+/* The request body, None or anything with a contiguous buffer, or a str,
+   which is sent UTF-8 encoded.  The buffer is held, not copied, until the
+   request completes, which also stops a bytearray from being resized. */
+bool get_request_body(PyObject *data, Py_buffer *view)
+{
+    if(data == Py_None) {
+        return true;
+    }
+    if(PyUnicode_Check(data)) {
+        Py_ssize_t len;
+        const char *utf8 = PyUnicode_AsUTF8AndSize(data, &len);
+        return utf8 != NULL && PyBuffer_FillInfo(view, data, (void *)utf8, len, 1, PyBUF_SIMPLE) == 0;
+    }
+    if(!PyObject_CheckBuffer(data)) {
+        PyErr_SetString(PyExc_TypeError, "data should be str, a bytes-like object or None");
+        return false;
+    }
+    return PyObject_GetBuffer(data, view, PyBUF_SIMPLE) == 0;
+}
 
-    static char *kwlist[] = {
-      "future", "method", "url", "headers", "auth",
-      "cookies", "data", "dummy", "cert", NULL
-    };
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OssOOOz#pO", kwlist,
-                                     &future, &method, &url, &headers,
-                                     &auth, &cookies, &req_data_buf,
-                                     &req_data_len, &dummy, &cert)) {
-        return NULL;
+/* Easy handle pool.  Handles a session is done with are reset and kept
+   for its next requests, which saves setting up curl's per-handle state
+   and buffers again each time.  Event loop thread only. */
+
+CURL *handle_pool_get(EventLoop *loop, Session *session)
+{
+    AcHandlePool *handles = session->handles;
+    if(handles->count > 0) {
+        loop->stats.easy_handles_reused++;
+        return handles->handles[--handles->count];
     }
+    loop->stats.easy_handles_created++;
+    return curl_easy_init();
+}
 
-    AcRequestData *rd = (AcRequestData *)malloc(sizeof(AcRequestData));
-    REQUEST_TRACE_PRINT("Session_request", rd);
-    memset(rd, 0, sizeof(AcRequestData));
-    if(headers != Py_None) {
-        if(!PyTuple_CheckExact(headers)) {
-            PyErr_SetString(PyExc_ValueError, "headers should be a tuple of strings or None");
-            goto error_cleanup;
-        }
-        for(int i=0; i < PyTuple_GET_SIZE(headers); i++) {
-            if(!PyUnicode_CheckExact(PyTuple_GET_ITEM(headers, i))) {
-                PyErr_SetString(PyExc_ValueError, "headers should be a tuple of strings or None");
-                goto error_cleanup;
-            }
-            rd->headers = curl_slist_append(rd->headers, PyUnicode_AsUTF8(PyTuple_GET_ITEM(headers, i)));
-        }
+/* From the cleanup pipe, once the response or failed request which had the
+   handle is gone */
+void handle_pool_put(AcHandlePool *handles, CURL *curl)
+{
+    if(handles->count < handles->max) {
+        curl_easy_reset(curl);
+        handles->handles[handles->count++] = curl;
     }
-    if(auth != Py_None) {
-        if(!PyTuple_CheckExact(auth) ||
-           PyTuple_GET_SIZE(auth) != 2 ||
-           !PyUnicode_CheckExact(PyTuple_GET_ITEM(auth, 0)) ||
-           !PyUnicode_CheckExact(PyTuple_GET_ITEM(auth, 1))) {
-	    PyErr_SetString(PyExc_ValueError, "auth should be a tuple of strings (username, password) or None");
-            goto error_cleanup;
+    else {
+        curl_easy_cleanup(curl);
+    }
+}
+
+/* Also cleans up the share, once its handles are gone */
+void handle_pool_free(AcHandlePool *handles)
+{
+    for(size_t i = 0; i < handles->count; i++) {
+        curl_easy_cleanup(handles->handles[i]);
+    }
+    if(handles->shared != NULL) {
+        CURLSHcode cs = curl_share_cleanup(handles->shared);
+        if (cs != 0) {
+            fprintf(stderr, "Got bad code cleaning up shared %p: %d\n", (void*)handles->shared, cs);
         }
-        const char *username = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 0));
-        const char *password = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 1));
-        rd->auth = (char*)malloc(strlen(username) + 1 + strlen(password) + 1);
-        sprintf(rd->auth, "%s:%s", username, password);
-    }
-    if(cert != Py_None) {
-	if(!PyTuple_CheckExact(cert) ||
-           PyTuple_GET_SIZE(cert) != 2 ||
-           !PyUnicode_CheckExact(PyTuple_GET_ITEM(cert, 0)) ||
-           !PyUnicode_CheckExact(PyTuple_GET_ITEM(cert, 1))) {
-            PyErr_SetString(PyExc_ValueError, "cert should be a tuple of strings (certificate path, key path) or None");
-            goto error_cleanup;
+    }
+    free(handles->handles);
+    free(handles);
+}
+
+
+/* Argument parsing shared with prepared.c.  Each sets an exception and
+   returns false if the argument is no good. */
+
+bool parse_body_mode(const char *body_mode, BodyMode *mode)
+{
+    *mode = BodyStore;
+    if (body_mode == NULL) {
+        return true;
+    }
+    if (strcmp(body_mode, "discard") == 0) {
+        *mode = BodyDiscard;
+    }
+    else if (strcmp(body_mode, "count") == 0) {
+        *mode = BodyCount;
+    }
+    else if (strcmp(body_mode, "stream") == 0) {
+        *mode = BodyStream;
+    }
+    else if (strcmp(body_mode, "store") != 0) {
+        PyErr_SetString(PyExc_ValueError, "body_mode should be 'store', 'discard', 'count', 'stream' or None");
+        return false;
+    }
+    return true;
+}
+
+/* Appends to *list, which the caller frees even on failure */
+bool build_header_list(PyObject *headers, struct curl_slist **list)
+{
+    if(headers == Py_None) {
+        return true;
+    }
+    if(!PyTuple_CheckExact(headers)) {
+        PyErr_SetString(PyExc_ValueError, "headers should be a tuple of strings or None");
+        return false;
+    }
+    for(int i=0; i < PyTuple_GET_SIZE(headers); i++) {
+        if(!PyUnicode_CheckExact(PyTuple_GET_ITEM(headers, i))) {
+            PyErr_SetString(PyExc_ValueError, "headers should be a tuple of strings or None");
+            return false;
         }
-        DEBUG_PRINT("PRE variables",);
-        const char *cert_path = PyUnicode_AsUTF8(PyTuple_GET_ITEM(cert, 0));
-        const char *key_path = PyUnicode_AsUTF8(PyTuple_GET_ITEM(cert, 1));
-        DEBUG_PRINT("PRE malloc",);
-        /* FIXME: use strndup */
-        rd->ca_cert = (char*)malloc(strlen(cert_path) + 1);
-        rd->ca_key = (char*)malloc(strlen(key_path) + 1);
-        DEBUG_PRINT("PRE sprintf",);
-        sprintf(rd->ca_cert, "%s", cert_path);
-        sprintf(rd->ca_key, "%s", key_path);
+        *list = curl_slist_append(*list, PyUnicode_AsUTF8(PyTuple_GET_ITEM(headers, i)));
+    }
+    return true;
+}
+
+/* username:password for CURLOPT_USERPWD */
+bool format_auth(PyObject *auth, char **userpwd)
+{
+    if(auth == Py_None) {
+        return true;
+    }
+    if(!PyTuple_CheckExact(auth) ||
+       PyTuple_GET_SIZE(auth) != 2 ||
+       !PyUnicode_CheckExact(PyTuple_GET_ITEM(auth, 0)) ||
+       !PyUnicode_CheckExact(PyTuple_GET_ITEM(auth, 1))) {
+        PyErr_SetString(PyExc_ValueError, "auth should be a tuple of strings (username, password) or None");
+        return false;
+    }
+    const char *username = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 0));
+    const char *password = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 1));
+    *userpwd = (char*)malloc(strlen(username) + 1 + strlen(password) + 1);
+    sprintf(*userpwd, "%s:%s", username, password);
+    return true;
+}
+
+bool copy_cert(PyObject *cert, char **cert_path, char **key_path)
+{
+    if(cert == Py_None) {
+        return true;
+    }
+    if(!PyTuple_CheckExact(cert) ||
+       PyTuple_GET_SIZE(cert) != 2 ||
+       !PyUnicode_CheckExact(PyTuple_GET_ITEM(cert, 0)) ||
+       !PyUnicode_CheckExact(PyTuple_GET_ITEM(cert, 1))) {
+        PyErr_SetString(PyExc_ValueError, "cert should be a tuple of strings (certificate path, key path) or None");
+        return false;
+    }
+    *cert_path = strdup(PyUnicode_AsUTF8(PyTuple_GET_ITEM(cert, 0)));
+    *key_path = strdup(PyUnicode_AsUTF8(PyTuple_GET_ITEM(cert, 1)));
+    return true;
+}
+
+/* Give a filled in request its session and future, ready to be pushed to
+   the event loop; detach_request undoes it */
+static bool attach_request(Session *session, AcRequestData *rd, PyObject *future)
+{
+    if(rd->body_mode == BodyStream && (rd->stream = stream_new(rd)) == NULL) {
+        PyErr_NoMemory();
+        return false;
+    }
+    Py_INCREF(session);
+    rd->session = session;
+    Py_INCREF(future);
+    rd->future = future;
+    return true;
+}
+
+static void detach_request(AcRequestData *rd)
+{
+    free(rd->stream);
+    rd->stream = NULL;
+    Py_CLEAR(rd->session);
+    Py_CLEAR(rd->future);
+}
+
+/* Hand a filled in request to the event loop.  On failure the caller
+   still has to free what it put in rd. */
+bool queue_request(Session *session, AcRequestData *rd, PyObject *future)
+{
+    if(!attach_request(session, rd, future)) {
+        return false;
+    }
+    if (!ring_push(&session->loop->req_in, rd)) {
+        PyErr_SetString(PyExc_RuntimeError, "too many requests waiting to be started");
+        detach_request(rd);
+        return false;
+    }
+    DEBUG_PRINT("scheduling request",);
+    return true;
+}
+
+/* Free a request which never made it to the event loop */
+static void free_request(Session *self, AcRequestData *rd)
+{
+    free(rd->method);
+    free(rd->url);
+    if(rd->headers) {
+        curl_slist_free_all(rd->headers);
+    }
+    if(rd->auth) {
+        free(rd->auth);
+    }
+    if(rd->ca_cert) {
+	free(rd->ca_cert);
+    }
+    if(rd->ca_key) {
+        free(rd->ca_key);
+    }
+    if(rd->cookies) {
+        Py_DECREF(rd->cookies);
+        free(rd->cookies_str);
+    }
+    PyBuffer_Release(&rd->req_data);
+    if(rd->file != NULL) {
+        file_sink_close(rd->file);
+    }
+    pool_put(&self->loop->request_pool, rd);
+}
+
+
+/* Fill in a request from Session.request's arguments, taking a fresh
+   AcRequestData from the pool.  Returns NULL with an exception set on
+   failure. */
+static AcRequestData *new_request(Session *self, const char *method, const char *url,
+                                  PyObject *headers, PyObject *auth, PyObject *cookies,
+                                  PyObject *data, PyObject *cert, BodyMode mode)
+{
+    AcRequestData *rd = (AcRequestData *)pool_get(&self->loop->request_pool);
+    if(rd == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    REQUEST_TRACE_PRINT("Session_request", rd);
+    memset(rd, 0, sizeof(AcRequestData));
+    rd->body_mode = mode;
+    if(!get_request_body(data, &rd->req_data)) {
+        goto error_cleanup;
+    }
+    if(!build_header_list(headers, &rd->headers) ||
+       !format_auth(auth, &rd->auth) ||
+       !copy_cert(cert, &rd->ca_cert, &rd->ca_key)) {
+        goto error_cleanup;
     }
     if(cookies != Py_None) {
         Py_INCREF(cookies);
@@ -129,50 +309,171 @@ Session_request(Session *self, PyObject *args, PyObject *kwds)
             }
         }
     }
-    Py_INCREF(self);
-    rd->session = self;
-    Py_INCREF(future);
-    rd->future = future;
     rd->method = strdup(method);
     rd->url = strdup(url);
-    if(req_data_buf != NULL) {
-        req_data_buf = strdup(req_data_buf);
+    return rd;
+
+    error_cleanup:
+    free_request(self, rd);
+    return NULL;
+}
+
+/* Session.request's parameters, in order; the first nine are required */
+enum {
+    REQUEST_FUTURE, REQUEST_METHOD, REQUEST_URL, REQUEST_HEADERS, REQUEST_AUTH,
+    REQUEST_COOKIES, REQUEST_DATA, REQUEST_DUMMY, REQUEST_CERT, REQUEST_BODY_MODE,
+    REQUEST_DOWNLOAD_TO, REQUEST_DIRECT, REQUEST_ARGS
+};
+
+static PyObject *
+Session_request(Session *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *values[REQUEST_ARGS];
+    const char *method = NULL;
+    const char *url = NULL;
+    int dummy;
+    const char *body_mode = NULL;
+    const char *download_to = NULL;
+    int direct = 0;
+    BodyMode mode;
+    AcRequestData *rd;
+
+    static const char *const names[REQUEST_ARGS] = {
+      "future", "method", "url", "headers", "auth",
+      "cookies", "data", "dummy", "cert", "body_mode",
+      "download_to", "direct"
+    };
+    static PyObject *interned[REQUEST_ARGS];
+
+    if (!parse_fastcall_args("request", names, interned, REQUEST_ARGS, REQUEST_BODY_MODE,
+                             args, nargs, kwnames, values) ||
+        !parse_string_arg("request", "method", values[REQUEST_METHOD], false, &method) ||
+        !parse_string_arg("request", "url", values[REQUEST_URL], false, &url) ||
+        (dummy = PyObject_IsTrue(values[REQUEST_DUMMY])) < 0 ||
+        !parse_string_arg("request", "body_mode", values[REQUEST_BODY_MODE], true, &body_mode) ||
+        !parse_string_arg("request", "download_to", values[REQUEST_DOWNLOAD_TO], true, &download_to) ||
+        (values[REQUEST_DIRECT] != NULL && (direct = PyObject_IsTrue(values[REQUEST_DIRECT])) < 0)) {
+        return NULL;
+    }
+    if (!parse_body_mode(body_mode, &mode)) {
+        return NULL;
+    }
+    if (download_to != NULL) {
+        if (body_mode != NULL) {
+            PyErr_SetString(PyExc_ValueError, "use only one or none of body_mode or download_to");
+            return NULL;
+        }
+        mode = BodyFile;
+    }
+
+    rd = new_request(self, method, url, values[REQUEST_HEADERS], values[REQUEST_AUTH],
+                     values[REQUEST_COOKIES], values[REQUEST_DATA], values[REQUEST_CERT], mode);
+    if(rd == NULL) {
+        return NULL;
     }
-    rd->req_data_len = req_data_len;
-    rd->req_data_buf = req_data_buf;
     rd->dummy = dummy;
-    ssize_t ret = write(self->loop->req_in_write, &rd, sizeof(AcRequestData *));
-    if (ret < (ssize_t)sizeof(AcRequestData *)) {
-        fprintf(stderr, "error writing to req_in_write");
-        exit(1);
+    if(download_to != NULL && (rd->file = file_sink_open(download_to, direct)) == NULL) {
+        free_request(self, rd);
+        return NULL;
+    }
+    if(!queue_request(self, rd, values[REQUEST_FUTURE])) {
+        free_request(self, rd);
+        return NULL;
     }
-    DEBUG_PRINT("scheduling request",);
     Py_RETURN_NONE;
+}
 
-    error_cleanup:
-    if(rd->headers) {
-        curl_slist_free_all(rd->headers);
+
+/* Many requests at once, each a tuple of Session.request's arguments
+   (future, method, url, headers, auth, cookies, data, cert).  They are all
+   checked before any is sent, and then pushed to the event loop together,
+   so either all of them are sent or, with an exception, none are. */
+static PyObject *
+Session_request_many(Session *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *values[2];
+    PyObject *requests;
+    const char *body_mode = NULL;
+    BodyMode mode;
+    AcRequestData **rds;
+    Py_ssize_t count;
+    Py_ssize_t filled = 0;
+
+    static const char *const names[] = {"requests", "body_mode"};
+    static PyObject *interned[2];
+
+    if (!parse_fastcall_args("request_many", names, interned, 2, 1, args, nargs, kwnames, values) ||
+        !parse_string_arg("request_many", "body_mode", values[1], true, &body_mode)) {
+        return NULL;
     }
-    if(rd->auth) {
-        free(rd->auth);
+    requests = values[0];
+    if (!parse_body_mode(body_mode, &mode)) {
+        return NULL;
     }
-    if(rd->ca_cert) {
-	free(rd->ca_cert);
+    requests = PySequence_Fast(requests, "requests should be a sequence of tuples");
+    if (requests == NULL) {
+        return NULL;
     }
-    if(rd->ca_key) {
-        free(rd->ca_key);
+    count = PySequence_Fast_GET_SIZE(requests);
+    rds = (AcRequestData **)malloc(sizeof(AcRequestData *) * (size_t)(count > 0 ? count : 1));
+    if (rds == NULL) {
+        Py_DECREF(requests);
+        return PyErr_NoMemory();
     }
-    if(rd->cookies) {
-        Py_DECREF(rd->cookies);
-        free(rd->cookies_str);
+    for (; filled < count; filled++) {
+        PyObject *spec = PySequence_Fast_GET_ITEM(requests, filled);
+        const char *method, *url;
+        if (!PyTuple_CheckExact(spec) || PyTuple_GET_SIZE(spec) != 8) {
+            PyErr_SetString(PyExc_ValueError, "each request should be a tuple of "
+                            "(future, method, url, headers, auth, cookies, data, cert)");
+            goto error_cleanup;
+        }
+        if (!parse_string_arg("request_many", "method", PyTuple_GET_ITEM(spec, 1), false, &method) ||
+            !parse_string_arg("request_many", "url", PyTuple_GET_ITEM(spec, 2), false, &url)) {
+            goto error_cleanup;
+        }
+        rds[filled] = new_request(self, method, url,
+                                  PyTuple_GET_ITEM(spec, 3), PyTuple_GET_ITEM(spec, 4),
+                                  PyTuple_GET_ITEM(spec, 5), PyTuple_GET_ITEM(spec, 6),
+                                  PyTuple_GET_ITEM(spec, 7), mode);
+        if (rds[filled] == NULL) {
+            goto error_cleanup;
+        }
+        if (!attach_request(self, rds[filled], PyTuple_GET_ITEM(spec, 0))) {
+            free_request(self, rds[filled]);
+            goto error_cleanup;
+        }
     }
-    free(rd);
+    if (!ring_push_many(&self->loop->req_in, (void **)rds, (size_t)count)) {
+        PyErr_SetString(PyExc_RuntimeError, "too many requests waiting to be started");
+        goto error_cleanup;
+    }
+    free(rds);
+    Py_DECREF(requests);
+    Py_RETURN_NONE;
+
+    error_cleanup:
+    for (Py_ssize_t i = 0; i < filled; i++) {
+        detach_request(rds[i]);
+        free_request(self, rds[i]);
+    }
+    free(rds);
+    Py_DECREF(requests);
     return NULL;
 }
 
 
+static PyObject *
+Session_prepare(Session *self, PyObject *args, PyObject *kwds)
+{
+    return prepared_new(self, args, kwds);
+}
+
+
 static PyMethodDef Session_methods[] = {
-    {"request", (PyCFunction)Session_request, METH_VARARGS | METH_KEYWORDS, "Send a request"},
+    {"request", (PyCFunction)Session_request, METH_FASTCALL | METH_KEYWORDS, "Send a request"},
+    {"request_many", (PyCFunction)Session_request_many, METH_FASTCALL | METH_KEYWORDS, "Send a sequence of requests together"},
+    {"prepare", (PyCFunction)Session_prepare, METH_VARARGS | METH_KEYWORDS, "Make a PreparedRequest to send many times"},
     {NULL, NULL, 0, NULL}
 };
 
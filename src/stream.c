@@ -0,0 +1,273 @@
+#include "acurl.h"
+
+/* Streamed response bodies.
+ *
+ * Each of curl's writes is copied into BufferNodes from the loop's pool and
+ * queued on the stream, a single-producer/single-consumer ring.  When there
+ * isn't room the write is refused with CURL_WRITEFUNC_PAUSE, and once the
+ * python thread has read from the queue it pushes the stream onto the loop's
+ * resume stack, which has the loop thread resume the transfer.  Like the
+ * pools' returned stacks, it is lock-free, can't fill up and is only ever
+ * taken whole, so a resume can't be lost.
+ *
+ * The python thread hears about a stream through the completion ring like
+ * any other request, except that the request data is pushed whenever there
+ * is something new (at most once until the python thread has seen it, see
+ * notified) and is only freed once the transfer is done.  The first push is
+ * as soon as the final response's headers are in, and the request's future
+ * is resolved with the Response then, without waiting for the body.  After
+ * that it is the reader's waiter future, if it is waiting.
+ *
+ * paused, notified and done are each set by one thread and taken back by
+ * the other after it has looked at the state they guard, with sequentially
+ * consistent atomics, so that one side always sees the other's change. */
+
+AcStream *stream_new(AcRequestData *rd)
+{
+    AcStream *stream = (AcStream *)calloc(1, sizeof(AcStream));
+    if(stream != NULL) {
+        stream->rd = rd;
+    }
+    return stream;
+}
+
+static void free_stream(EventLoop *loop, AcStream *stream)
+{
+    size_t head = atomic_load(&stream->head);
+    for(size_t i = atomic_load(&stream->tail); i != head; i++) {
+        free_buffer_nodes(loop, stream->chunks[i & (STREAM_QUEUE_CHUNKS - 1)]);
+    }
+    Py_XDECREF(stream->waiter);
+    free(stream);
+}
+
+/* Event loop thread */
+
+static void notify(EventLoop *loop, AcRequestData *rd)
+{
+    if(!atomic_exchange(&rd->stream->notified, true)) {
+        push_completed(loop, rd);
+    }
+}
+
+static size_t queue_space(AcStream *stream)
+{
+    return STREAM_QUEUE_CHUNKS - (atomic_load_explicit(&stream->head, memory_order_relaxed) -
+                                  atomic_load(&stream->tail));
+}
+
+size_t stream_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    AcRequestData *rd = (AcRequestData *)userdata;
+    AcStream *stream = rd->stream;
+    EventLoop *loop = rd->session->loop;
+    size_t len = size * nmemb;
+    size_t needed = (len + BUFFER_NODE_CAPACITY - 1) / BUFFER_NODE_CAPACITY;
+    size_t head;
+    if(atomic_load(&stream->abandoned)) {
+        /* Nobody is reading, so fail the transfer to stop it */
+        return 0;
+    }
+    /* No more header data is taken once the response may have been handed
+       out, see header_callback */
+    stream->headers_done = true;
+    if(queue_space(stream) < needed) {
+        /* If the reader has made room since, and hasn't already taken paused
+           back to resume us, carry on */
+        atomic_store(&stream->paused, true);
+        if(queue_space(stream) < needed || !atomic_exchange(&stream->paused, false)) {
+            DEBUG_PRINT("pausing stream rd=%p", rd);
+            return CURL_WRITEFUNC_PAUSE;
+        }
+    }
+    head = atomic_load_explicit(&stream->head, memory_order_relaxed);
+    for(size_t offset = 0; offset < len; offset += BUFFER_NODE_CAPACITY) {
+        BufferNode *node = (BufferNode *)pool_get(&loop->buffer_pool);
+        if(unlikely(node == NULL)) {
+            len = offset;
+            break;
+        }
+        node->next = NULL;
+        node->len = len - offset < BUFFER_NODE_CAPACITY ? len - offset : BUFFER_NODE_CAPACITY;
+        memcpy(node->buffer, ptr + offset, node->len);
+        stream->chunks[head++ & (STREAM_QUEUE_CHUNKS - 1)] = node;
+    }
+    atomic_store(&stream->head, head);
+    notify(loop, rd);
+    return len;
+}
+
+/* From header_callback, at the end of the final response's headers.  The
+   python thread may take them from here on. */
+void stream_headers_complete(EventLoop *loop, AcRequestData *rd)
+{
+    rd->stream->headers_done = true;
+    notify(loop, rd);
+}
+
+/* From start_request, after req_in's eventfd has been cleared.  A paused
+   transfer can't finish, so the streams and their request data are still
+   there.  That rests on setup_request not giving curl any timeout, which
+   it would still enforce on a paused transfer; see the note there. */
+void stream_resume_all(EventLoop *loop)
+{
+    AcStream *stream = atomic_exchange_explicit(&loop->resume, NULL, memory_order_acquire);
+    while(stream != NULL) {
+        /* Resuming runs stream_callback, which may pause the transfer again
+           and have it pushed back on before we're done here */
+        AcStream *next = stream->resume_next;
+        DEBUG_PRINT("resuming stream rd=%p", stream->rd);
+        curl_easy_pause(stream->rd->curl, CURLPAUSE_CONT);
+        stream = next;
+    }
+}
+
+/* Instead of push_completed, once the transfer is over */
+void stream_complete(EventLoop *loop, AcRequestData *rd)
+{
+    atomic_store(&rd->stream->done, true);
+    notify(loop, rd);
+}
+
+/* Python thread */
+
+/* Have the event loop resume a paused transfer.  The loop is woken through
+   req_in's eventfd when the stack was empty; otherwise it already has been,
+   and will take this along with the rest. */
+void stream_resume(AcRequestData *rd)
+{
+    EventLoop *loop = rd->session->loop;
+    AcStream *stream = rd->stream;
+    AcStream *head = atomic_load_explicit(&loop->resume, memory_order_relaxed);
+    do {
+        stream->resume_next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&loop->resume, &head, stream,
+                                                   memory_order_release, memory_order_relaxed));
+    if(head == NULL) {
+        ring_wakeup(&loop->req_in);
+    }
+}
+
+/* Called with a streamed request taken off the completion ring.  As with
+   take_completed, *future and *value get what to resolve, but either may
+   be NULL if there is nothing to do. */
+bool take_stream_event(AcRequestData *rd, PyObject **future, PyObject **value)
+{
+    AcStream *stream = rd->stream;
+    Session *session = rd->session;
+    bool ok = true;
+    bool done;
+    *future = NULL;
+    *value = NULL;
+    atomic_store(&stream->notified, false);
+    done = atomic_load(&stream->done);
+    if(!stream->started) {
+        stream->started = true;
+        *future = rd->future;
+        rd->future = NULL;
+        ok = !done || rd->result == CURLE_OK;
+        if(ok) {
+            Response *response = PyObject_New(Response, (PyTypeObject *)&ResponseType);
+            response->header = rd->header;
+            memset(&rd->header, 0, sizeof(HeaderBuffer));
+            memset(&response->body, 0, sizeof(BodyBuffer));
+            response->exports = 0;
+            response->body_mode = BodyStream;
+            response->body_checksum = 0;
+            response->stream = stream;
+            response->curl = rd->curl;
+            Py_INCREF(session);
+            response->session = session;
+            stream->response = response;
+            *value = (PyObject*)response;
+        }
+        else {
+            *value = PyUnicode_FromString(curl_easy_strerror(rd->result));
+        }
+    }
+    else if(stream->waiter != NULL) {
+        *future = stream->waiter;
+        stream->waiter = NULL;
+        Py_INCREF(Py_None);
+        *value = Py_None;
+    }
+    if(done) {
+        REQUEST_TRACE_PRINT("take_stream_event done", rd);
+        stream->result = rd->result;
+        stream->finished = true;
+        stream->rd = NULL;
+        /* Unless a response has the curl handle and the stream, the
+           request failed before there was one, or it was dropped */
+        if(stream->response == NULL) {
+            free_header_buffer(session->loop, &rd->header);
+            schedule_cleanup_curl_easy(session, rd->curl);
+            free_stream(session->loop, stream);
+        }
+        PyBuffer_Release(&rd->req_data);
+        Py_XDECREF(rd->cookies);
+        Py_XDECREF(rd->prepared);
+        pool_put(&session->loop->request_pool, rd);
+        Py_DECREF(session);
+    }
+    return ok;
+}
+
+/* Everything queued, as one bytes object; b'' with waiter saved to be
+   resolved when there is more; or None at the end of the body */
+PyObject *stream_read(Response *response, PyObject *waiter)
+{
+    AcStream *stream = response->stream;
+    size_t tail = atomic_load_explicit(&stream->tail, memory_order_relaxed);
+    size_t head = atomic_load(&stream->head);
+    size_t len = 0;
+    PyObject *bytes;
+    char *data;
+    if(head == tail) {
+        if(stream->finished) {
+            Py_RETURN_NONE;
+        }
+        Py_INCREF(waiter);
+        Py_XSETREF(stream->waiter, waiter);
+        return PyBytes_FromStringAndSize(NULL, 0);
+    }
+    for(size_t i = tail; i != head; i++) {
+        len += stream->chunks[i & (STREAM_QUEUE_CHUNKS - 1)]->len;
+    }
+    bytes = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)len);
+    if(bytes == NULL) {
+        return NULL;
+    }
+    data = PyBytes_AS_STRING(bytes);
+    for(size_t i = tail; i != head; i++) {
+        BufferNode *node = stream->chunks[i & (STREAM_QUEUE_CHUNKS - 1)];
+        memcpy(data, node->buffer, node->len);
+        data += node->len;
+        /* Chain them up to go back to the pool together */
+        node->next = i + 1 != head ? stream->chunks[(i + 1) & (STREAM_QUEUE_CHUNKS - 1)] : NULL;
+    }
+    free_buffer_nodes(response->session->loop, stream->chunks[tail & (STREAM_QUEUE_CHUNKS - 1)]);
+    atomic_store(&stream->tail, head);
+    if(stream->rd != NULL && atomic_exchange(&stream->paused, false)) {
+        stream_resume(stream->rd);
+    }
+    return bytes;
+}
+
+/* From Response_dealloc.  Returns false if the transfer is still going,
+   in which case it is stopped and cleaned up when it finishes, and the
+   response mustn't touch its curl handle. */
+bool stream_release(Response *response)
+{
+    AcStream *stream = response->stream;
+    Py_CLEAR(stream->waiter);
+    if(stream->finished) {
+        free_stream(response->session->loop, stream);
+        return true;
+    }
+    stream->response = NULL;
+    atomic_store(&stream->abandoned, true);
+    if(atomic_exchange(&stream->paused, false)) {
+        stream_resume(stream->rd);
+    }
+    return false;
+}
@@ -0,0 +1,48 @@
+/* Timer A reschedules itself and timer B, due in the same pass, deletes it.
+ * A must not run again and must be finalized exactly once.  Built and run
+ * by test_timer_deleted_by_another_timer. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/ae/ae.h"
+
+static long long timer_a;
+static int a_runs;
+static int a_finalized;
+
+static int run_a(aeEventLoop *eventLoop, long long id, void *clientData)
+{
+    printf("A runs id=%lld\n", id);
+    a_runs++;
+    return 1;
+}
+
+static void finalize_a(aeEventLoop *eventLoop, void *clientData)
+{
+    a_finalized++;
+}
+
+static int run_b(aeEventLoop *eventLoop, long long id, void *clientData)
+{
+    printf("B deletes A -> %d\n", aeDeleteTimeEvent(eventLoop, timer_a));
+    return AE_NOMORE;
+}
+
+int main(void)
+{
+    aeEventLoop *eventLoop = aeCreateEventLoop(64);
+    struct timespec ms = {0, 1000000};
+    int i;
+
+    timer_a = aeCreateTimeEvent(eventLoop, 0, run_a, NULL, finalize_a);
+    aeCreateTimeEvent(eventLoop, 0, run_b, NULL, NULL);
+    for (i = 0; i < 5; i++) {
+        nanosleep(&ms, NULL);
+        aeProcessEvents(eventLoop, AE_TIME_EVENTS | AE_DONT_WAIT);
+    }
+    printf("A ran %d times, finalized %d times, %d timers left\n",
+           a_runs, a_finalized, aeGetNextTimeEventNs(eventLoop) == -1 ? 0 : 1);
+    aeDeleteEventLoop(eventLoop);
+    return a_runs == 1 && a_finalized == 1 ? 0 : 1;
+}
@@ -0,0 +1,750 @@
+import acurl
+import asyncio
+import contextlib
+import os
+import resource
+import shutil
+import subprocess
+import sysconfig
+import threading
+import pytest
+
+
+CONNECTIONS = 3000
+
+
+def _await(awaitable):
+    return asyncio.get_event_loop().run_until_complete(awaitable)
+
+
+def _raise_fd_limit(needed):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft != resource.RLIM_INFINITY and soft < needed:
+        if hard != resource.RLIM_INFINITY and hard < needed:
+            pytest.skip('RLIMIT_NOFILE hard limit is below {}'.format(needed))
+        resource.setrlimit(resource.RLIMIT_NOFILE, (needed, hard))
+
+
+@contextlib.asynccontextmanager
+async def _server(handle, backlog=100):
+    """The url of a server which passes each connection to handle(reader,
+    writer), closed on the way out."""
+    server = await asyncio.start_server(handle, '127.0.0.1', 0, backlog=backlog)
+    try:
+        yield 'http://127.0.0.1:{}/'.format(server.sockets[0].getsockname()[1])
+    finally:
+        server.close()
+
+
+@contextlib.asynccontextmanager
+async def _running(handle, backlog=100, **loop_kwargs):
+    """Like _server, along with an EventLoop made with loop_kwargs, which is
+    stopped on the way out."""
+    async with _server(handle, backlog) as url:
+        el = acurl.EventLoop(**loop_kwargs)
+        try:
+            yield el, url
+        finally:
+            el.stop()
+
+
+def _barrier(count):
+    """A handler which holds every request until `count` of them are open at
+    once, so that the client has to be polling all of those sockets."""
+    arrived = 0
+    all_arrived = asyncio.Event()
+
+    async def handle(reader, writer):
+        nonlocal arrived
+        await reader.readuntil(b'\r\n\r\n')
+        arrived += 1
+        if arrived == count:
+            all_arrived.set()
+        await all_arrived.wait()
+        writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok')
+        await writer.drain()
+        writer.close()
+
+    return handle
+
+
+def test_timer_deleted_by_another_timer(tmp_path):
+    # The ae loop isn't reachable from python, so build a small harness
+    # against it
+    cc = (sysconfig.get_config_var('CC') or 'cc').split()
+    if shutil.which(cc[0]) is None:
+        pytest.skip('no C compiler')
+    src = os.path.join(os.path.dirname(__file__), os.pardir, 'src', 'ae')
+    harness = str(tmp_path / 'ae_timers')
+    subprocess.run(cc + ['-o', harness, os.path.join(os.path.dirname(__file__), 'ae_timers.c'),
+                         os.path.join(src, 'ae.c'), os.path.join(src, 'zmalloc.c')], check=True)
+    result = subprocess.run([harness], stdout=subprocess.PIPE, universal_newlines=True)
+    assert result.stdout.splitlines() == [
+        'A runs id=0',
+        'B deletes A -> 0',
+        'A ran 1 times, finalized 1 times, 0 timers left',
+    ]
+    assert result.returncode == 0
+
+
+@pytest.mark.parametrize('backend', [None, 'io_uring'])
+def test_thousands_of_concurrent_connections(backend):
+    # The client and server ends of every connection live in this process
+    _raise_fd_limit(2 * CONNECTIONS + 256)
+
+    async def run():
+        async with _running(_barrier(CONNECTIONS), backlog=CONNECTIONS, backend=backend) as (el, url):
+            s = el.session()
+            responses = await asyncio.wait_for(
+                asyncio.gather(*[s.get(url) for _ in range(CONNECTIONS)]), 60)
+            stats = el.get_stats()
+        return responses, stats
+
+    responses, stats = _await(run())
+    # io_uring falls back to epoll on older kernels
+    assert stats['backend'] in ('epoll', backend or 'epoll')
+    assert stats['fd_table_size'] > CONNECTIONS
+    assert len(responses) == CONNECTIONS
+    assert all(r.status_code == 200 and r.body == b'ok' for r in responses)
+
+
+def _keep_alive(body=b'ok'):
+    """A handler which answers every request on a connection with body"""
+    async def handle(reader, writer):
+        try:
+            while True:
+                await reader.readuntil(b'\r\n\r\n')
+                writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n' % len(body) + body)
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        writer.close()
+
+    return handle
+
+
+def _chunked(body):
+    """A handler which sends body chunked, in pieces which aren't a multiple
+    of 8 bytes, and closes the connection"""
+    async def handle(reader, writer):
+        await reader.readuntil(b'\r\n\r\n')
+        writer.write(b'HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n')
+        for i in range(0, len(body), 1000):
+            piece = body[i:i + 1000]
+            writer.write(b'%x\r\n' % len(piece) + piece + b'\r\n')
+            await writer.drain()
+        writer.write(b'0\r\n\r\n')
+        await writer.drain()
+        writer.close()
+
+    return handle
+
+
+def test_keep_alive_poll_changes_per_request():
+    async def run():
+        async with _running(_keep_alive()) as (el, url):
+            s = el.session()
+            for _ in range(100):
+                r = await s.get(url)
+                assert r.status_code == 200
+            stats = el.get_stats()
+        return stats
+
+    stats = _await(run())
+    assert stats['completed_requests'] == 100
+    # Sending a request and waiting for its response is one switch to
+    # writing and one back to reading
+    assert stats['poll_ctl_per_request'] < 2.5
+
+
+def test_event_loop_pool_merges_completions():
+    async def run():
+        async with _server(_keep_alive()) as url:
+            pool = acurl.EventLoopPool(3, cpus={0})
+            sessions = [pool.session() for _ in range(6)]
+
+            async def client(s):
+                return [await s.get(url) for _ in range(20)]
+
+            results = await asyncio.wait_for(asyncio.gather(*[client(s) for s in sessions]), 30)
+            stats = pool.get_stats()
+            pool.stop()
+        return results, stats
+
+    results, stats = _await(run())
+    assert all(r.status_code == 200 and r.body == b'ok' for rs in results for r in rs)
+    assert [s['completed_requests'] for s in stats] == [40, 40, 40]
+
+
+def test_loop_thread_settings():
+    cpu = min(os.sched_getaffinity(0))
+
+    async def run():
+        el = acurl.EventLoop(cpus=[cpu], nice=5)
+        for _ in range(100):
+            if el.thread_id is not None:
+                break
+            await asyncio.sleep(0.01)
+        tid = el.thread_id
+        affinity = os.sched_getaffinity(tid)
+        priority = os.getpriority(os.PRIO_PROCESS, tid)
+        el.stop()
+        return tid, affinity, priority
+
+    tid, affinity, priority = _await(run())
+    assert tid != threading.get_native_id()
+    assert affinity == {cpu}
+    assert priority == 5
+    with pytest.raises(ValueError):
+        acurl._acurl.EventLoop(nice=20)
+
+
+def test_busy_poll_stats():
+    async def run():
+        async with _running(_keep_alive(), busy_poll_us=200) as (el, url):
+            s = el.session()
+            for _ in range(20):
+                r = await s.get(url)
+                assert r.status_code == 200
+            await asyncio.sleep(0.01)  # long enough for the loop to block again
+            stats = el.get_stats()
+        return stats
+
+    stats = _await(run())
+    assert stats['busy_poll_us'] == 200
+    assert stats['busy_poll_spins'] > 0
+    assert 0 < stats['busy_poll_hits'] <= stats['busy_poll_spins']
+    assert stats['busy_poll_blocks'] > 0
+    assert stats['busy_poll_work_ns'] > 0
+
+
+@pytest.mark.parametrize('backend', [None, 'io_uring'])
+def test_same_thread_without_polling(backend):
+    async def run():
+        async with _running(_keep_alive(), same_thread=True, backend=backend) as (el, url):
+            s = el.session()
+            responses = [await s.get(url) for _ in range(20)]
+            responses += await asyncio.gather(*[s.get(url) for _ in range(20)])
+        return responses
+
+    responses = _await(run())
+    assert all(r.status_code == 200 and r.body == b'ok' for r in responses)
+
+
+def test_cancelled_request_is_skipped():
+    release = asyncio.Event()
+
+    async def handle(reader, writer):
+        await reader.readuntil(b'\r\n\r\n')
+        await release.wait()
+        writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok')
+        await writer.drain()
+        writer.close()
+
+    async def run():
+        errors = []
+        asyncio.get_event_loop().set_exception_handler(lambda loop, context: errors.append(context))
+        async with _running(handle) as (el, url):
+            s = el.session()
+            with pytest.raises(asyncio.TimeoutError):
+                await asyncio.wait_for(s.get(url), 0.1)
+            release.set()
+            r = await s.get(url)
+            await asyncio.sleep(0.05)
+        asyncio.get_event_loop().set_exception_handler(None)
+        return r, errors
+
+    r, errors = _await(run())
+    assert r.status_code == 200
+    assert errors == []
+
+
+def test_binary_body_reuses_pooled_buffers():
+    body = bytes(range(256)) * 64
+
+    async def run():
+        async with _running(_keep_alive(body)) as (el, url):
+            s = el.session()
+            bodies = []
+            for _ in range(20):
+                r = await s.get(url)
+                bodies.append(r.body)
+                del r
+            stats = el.get_stats()
+        return bodies, stats
+
+    bodies, stats = _await(run())
+    assert all(b == body for b in bodies)
+    # Only the response being read is ever alive, so its header chunk and
+    # request are reused by the next one
+    assert stats['request_pool_misses'] == stats['request_pool_high_water'] == 1
+    assert stats['request_pool_hits'] == 19
+    assert stats['buffer_pool_misses'] == stats['buffer_pool_high_water'] == 1
+    assert stats['buffer_pool_hits'] == 19
+
+
+def _body_checksum(data):
+    # FNV-1a over little-endian 64 bit words, the last one padded with zeros
+    h = 0xcbf29ce484222325
+    for i in range(0, len(data), 8):
+        h = ((h ^ int.from_bytes(data[i:i + 8], 'little')) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+
+def test_body_without_content_length_grows():
+    body = bytes(range(256)) * 400
+
+    async def run():
+        async with _running(_chunked(body)) as (el, url):
+            s = el.session()
+            r = await s.get(url)
+            result = r.body
+            del r
+        return result
+
+    assert _await(run()) == body
+
+
+def test_body_view_keeps_response_alive():
+    async def run():
+        async with _running(_keep_alive()) as (el, url):
+            s = el.session()
+            r = await s.get(url)
+            view = r.body_view
+            del r
+            result = (view.readonly, view.tobytes())
+            with pytest.raises(TypeError):
+                view[0] = 0
+            view.release()
+        return result
+
+    assert _await(run()) == (True, b'ok')
+
+
+def test_body_modes():
+    body = bytes(range(256)) * 400
+
+    async def run():
+        async with _running(_keep_alive()) as (el, url), _server(_chunked(body)) as chunked_url:
+            s = el.session(body_mode='discard')
+            results = []
+            for body_mode in (None, 'store', 'count'):
+                r = await s.get(url, body_mode=body_mode)
+                results.append((r.body, r.body_checksum, r.download_size))
+            with pytest.raises(ValueError):
+                await s.get(url, body_mode='keep')
+            # The checksum doesn't depend on how the body arrives
+            r = await s.get(chunked_url, body_mode='count')
+            results.append(r.body_checksum)
+            del r
+        return results
+
+    assert _await(run()) == [(b'', None, 2), (b'ok', None, 2), (b'', _body_checksum(b'ok'), 2),
+                             _body_checksum(body)]
+
+
+def test_stream_pauses_for_slow_reader():
+    chunk = bytes(range(256)) * 256
+    count = 200
+    sent = []
+
+    async def handle(reader, writer):
+        await reader.readuntil(b'\r\n\r\n')
+        writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n' % (len(chunk) * count))
+        for i in range(count):
+            writer.write(chunk)
+            await writer.drain()
+            sent.append(i)
+        writer.close()
+
+    async def run():
+        async with _running(handle) as (el, url):
+            s = el.session()
+            r = await s.stream('GET', url)
+            status = r.status_code
+            # Nothing is read yet, so the transfer stops short of the whole body
+            await asyncio.sleep(0.3)
+            sent_before_reading = len(sent)
+            received = []
+            async for data in r.iter_body():
+                received.append(data)
+            del r
+        return status, sent_before_reading, b''.join(received)
+
+    status, sent_before_reading, body = _await(run())
+    assert status == 200
+    assert sent_before_reading < count
+    assert body == chunk * count
+
+
+def test_stream_returns_before_the_body():
+    release_body = asyncio.Event()
+
+    async def handle(reader, writer):
+        await reader.readuntil(b'\r\n\r\n')
+        # An interim response first, whose headers mustn't be taken as final
+        writer.write(b'HTTP/1.1 100 Continue\r\n\r\n')
+        writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: 4\r\nX-Final: yes\r\nConnection: close\r\n\r\n')
+        await writer.drain()
+        await release_body.wait()
+        writer.write(b'body')
+        await writer.drain()
+        writer.close()
+
+    async def run():
+        async with _running(handle) as (el, url):
+            s = el.session()
+            # The body is only sent once stream() has returned
+            r = await asyncio.wait_for(s.stream('GET', url), 5)
+            result = (r.status_code, r.headers['x-final'])
+            release_body.set()
+            received = []
+            async for data in r.iter_body():
+                received.append(data)
+            del r
+        return result, b''.join(received)
+
+    assert _await(run()) == ((200, 'yes'), b'body')
+
+
+def test_dropped_stream_is_cleaned_up():
+    async def handle(reader, writer):
+        await reader.readuntil(b'\r\n\r\n')
+        writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: 100000000\r\nConnection: close\r\n\r\n')
+        try:
+            while True:
+                writer.write(b'x' * 65536)
+                await writer.drain()
+        except ConnectionError:
+            pass
+        writer.close()
+
+    async def run():
+        async with _running(handle) as (el, url):
+            s = el.session()
+            r = await s.stream('GET', url)
+            await asyncio.sleep(0.1)
+            del r
+            # The dropped transfer is stopped and its request data handed back
+            for _ in range(100):
+                await asyncio.sleep(0.01)
+                if el.get_stats()['completed_requests'] == 1:
+                    break
+            stats = el.get_stats()
+        return stats
+
+    stats = _await(run())
+    assert stats['completed_requests'] == 1
+
+
+def test_headers_parsed_per_response():
+    many = ''.join('X-Field-{}: {}\r\n'.format(i, i) for i in range(300))
+    # Latin-1 names, short and long, are looked up the same way
+    latin1 = 'X-\xc9tat: short\r\nX-\xc9tat-{}: long\r\n'.format('A' * 300)
+
+    async def handle(reader, writer):
+        await reader.readuntil(b'\r\n\r\n')
+        writer.write(b'HTTP/1.1 100 Continue\r\nX-Interim: yes\r\n\r\n')
+        writer.write(b'HTTP/1.1 200 OK\r\nContent-Type:  text/plain \r\nSet-Cookie: a=1\r\n'
+                     b'set-cookie: b=2\r\nX-Long: ' + b'v' * 10000 + b'\r\n' + many.encode() +
+                     latin1.encode('latin-1') + b'Content-Length: 2\r\nConnection: close\r\n\r\nok')
+        await writer.drain()
+        writer.close()
+
+    async def run():
+        async with _running(handle) as (el, url):
+            s = el.session()
+            r = await s.get(url)
+            result = r.header, r.headers_tuple, r.headers, r.body
+            del r
+        return result
+
+    header, headers_tuple, headers, body = _await(run())
+    assert header.startswith('HTTP/1.1 200 OK\r\n') and header.endswith('\r\n\r\n')
+    assert headers_tuple[:3] == (('Content-Type', 'text/plain'), ('Set-Cookie', 'a=1'), ('set-cookie', 'b=2'))
+    assert len(headers_tuple) == 4 + 300 + 2 + 2
+    assert 'X-Interim' not in headers
+    assert headers['content-type'] == headers['CONTENT-TYPE'] == 'text/plain'
+    assert headers['Set-Cookie'] == 'b=2'
+    assert headers['X-Long'] == 'v' * 10000
+    assert headers['x-field-299'] == '299'
+    assert headers['X-\xc9TAT'] == 'short'
+    assert headers['x-\xc9tat-' + 'a' * 300] == 'long'
+    assert 'x-\xe9tat' not in headers
+    assert body == b'ok'
+
+
+def test_json_decoded_from_body():
+    import json
+    documents = [
+        b'{"a": [1, -2, 3.5, -0.25e-3, 1E400, 123456789012345678901234567890, true, false, null]}',
+        b' [ "plain ascii, long enough to be scanned in words", "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80" ] ',
+        b'"\\"\\\\\\/\\b\\f\\n\\r\\t \\u00e9 \\ud83d\\ude00 \\ud800"',
+        b'[{"k": 1}, {"k": 2}, {}, []]',
+        b'\xef\xbb\xbf{"bom": 1}',
+        b'"\\n caf\xc3\xa9 \xf0\x9f\x98\x80 \\udc00"',
+    ]
+    # Only escapes may make lone surrogates; raw text next to them is still
+    # strict UTF-8
+    invalid = [b'', b'[1,]', b'{"a" 1}', b'"unterminated', b'[1] x', b'01', b'"\xff"', b'"\x01"', b'[' * 100000,
+               b'"\xed\xa0\x80"', b'"\\n\xed\xa0\x80"', b'"\\n\xff"', b'"\\n\xc3"']
+
+    async def handle(reader, writer):
+        request = await reader.readuntil(b'\r\n\r\n')
+        path = request.split(b' ')[1]
+        if path == b'/latin1':
+            body, content_type = '{"caf\xe9": 1}'.encode('latin1'), b'application/json; charset=latin1'
+        else:
+            index = int(path[1:])
+            body = (documents + invalid)[index]
+            content_type = b'application/json'
+        writer.write(b'HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n'
+                     b'Connection: close\r\n\r\n%s' % (content_type, len(body), body))
+        await writer.drain()
+        writer.close()
+
+    async def run():
+        async with _running(handle) as (el, url):
+            s = el.session()
+            decoded = []
+            for i in range(len(documents)):
+                decoded.append((await s.get(url + str(i))).json())
+            errors = []
+            for i in range(len(invalid)):
+                r = await s.get(url + str(len(documents) + i))
+                try:
+                    r.json()
+                except (ValueError, RecursionError) as e:
+                    errors.append(e)
+            latin1 = (await s.get(url + 'latin1')).json()
+        return decoded, errors, latin1
+
+    decoded, errors, latin1 = _await(run())
+    assert decoded == [json.loads(d.decode('utf-8-sig'), parse_constant=None) for d in documents]
+    assert len(errors) == len(invalid)
+    assert latin1 == {'caf\xe9': 1}
+
+
+async def _read_request(reader, writer):
+    """One request off a connection, as (request line, [(name, value)],
+    body), or None once the client has closed it.  An Expect: 100-continue
+    is answered."""
+    try:
+        head = await reader.readuntil(b'\r\n\r\n')
+    except asyncio.IncompleteReadError:
+        return None
+    lines = head[:-4].split(b'\r\n')
+    headers = []
+    for line in lines[1:]:
+        name, _, value = line.partition(b':')
+        headers.append((name, value.strip()))
+    fields = {name.lower(): value for name, value in headers}
+    if fields.get(b'expect', b'').lower() == b'100-continue':
+        writer.write(b'HTTP/1.1 100 Continue\r\n\r\n')
+    body = await reader.readexactly(int(fields.get(b'content-length', 0)))
+    return lines[0], headers, body
+
+
+@contextlib.asynccontextmanager
+async def _serving(respond, backlog=100):
+    """An EventLoop and the url of a keep-alive server which answers every
+    request with a 200 whose body is respond(request line, headers, body),
+    both stopped on the way out."""
+    async def handle(reader, writer):
+        try:
+            while True:
+                request = await _read_request(reader, writer)
+                if request is None:
+                    break
+                body = respond(*request)
+                writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n' % len(body))
+                writer.write(body)
+                await writer.drain()
+        except ConnectionError:
+            pass
+        writer.close()
+
+    async with _running(handle, backlog) as (el, url):
+        yield el, url
+
+
+def test_request_bodies_sent_from_buffers():
+    import hashlib
+    large = bytes(range(256)) * (3 * 4096)  # goes through read_callback
+    bodies = [b'before\x00after', bytearray(b'\x00\xff' * 100), memoryview(b'0123456789')[2:7], 'caf\xe9', large]
+
+    def respond(line, headers, body):
+        return hashlib.sha1(body).hexdigest().encode()
+
+    async def run():
+        async with _serving(respond) as (el, url):
+            s = el.session()
+            digests = [(await s.post(url, data=body)).text for body in bodies]
+            with pytest.raises(TypeError):
+                await s.post(url, data=12)
+        return digests
+
+    expected = [hashlib.sha1(b.encode() if isinstance(b, str) else b).hexdigest() for b in bodies]
+    assert _await(run()) == expected
+
+
+def test_upload_and_download_files(tmp_path):
+    import hashlib
+    payload = os.urandom(2 * 1024 * 1024 + 12345)
+    upload = tmp_path / 'upload'
+    upload.write_bytes(payload)
+
+    def respond(line, headers, body):
+        return hashlib.sha1(body).hexdigest().encode() if line.startswith(b'POST') else payload
+
+    async def run():
+        async with _serving(respond) as (el, url):
+            s = el.session()
+            digest = (await s.post(url, upload_file=upload)).text
+            responses = [await s.get(url, download_to=tmp_path / 'buffered'),
+                         await s.get(url, download_to=tmp_path / 'direct', download_direct=True)]
+            with pytest.raises(FileNotFoundError):
+                await s.get(url, download_to=tmp_path / 'missing' / 'file')
+            with pytest.raises(ValueError):
+                await s.get(url, download_direct=True)
+            sizes = [r.download_size for r in responses]
+            bodies = [r.body for r in responses]
+            del responses
+        return digest, sizes, bodies
+
+    digest, sizes, bodies = _await(run())
+    assert digest == hashlib.sha1(payload).hexdigest()
+    assert sizes == [len(payload)] * 2
+    assert bodies == [b''] * 2
+    assert (tmp_path / 'buffered').read_bytes() == payload
+    assert (tmp_path / 'direct').read_bytes() == payload
+
+
+def test_easy_handles_reused():
+    def respond(line, headers, body):
+        return b'%s %d' % (line.split(b' ')[0], len(body))
+
+    async def run(max_handles):
+        async with _serving(respond) as (el, url):
+            s = el.session(max_handles=max_handles)
+            bodies = []
+            for i in range(50):
+                # A reused handle mustn't carry over the last request's options
+                r = await (s.post(url, data=b'x' * i) if i % 2 else s.get(url))
+                bodies.append(r.text)
+                del r
+                # Wait for the loop thread to take the handle back
+                for _ in range(500):
+                    if el.get_stats()['easy_handles_returned'] == i + 1:
+                        break
+                    await asyncio.sleep(0.01)
+                else:
+                    pytest.fail('handle {} was never given back to the pool'.format(i))
+            stats = el.get_stats()
+        return bodies, stats
+
+    bodies, stats = _await(run(None))
+    assert bodies == ['POST %d' % i if i % 2 else 'GET 0' for i in range(50)]
+    assert stats['easy_handles_created'] == 1
+    assert stats['easy_handles_reused'] == 49
+    bodies, stats = _await(run(0))
+    assert stats['easy_handles_created'] == 50
+    assert stats['easy_handles_reused'] == 0
+
+
+def test_prepared_request():
+    def respond(line, headers, body):
+        echoed = [b'%s: %s' % (name, value) for name, value in headers
+                  if name.lower() in (b'x-test', b'authorization')]
+        return b'\n'.join([line] + echoed + [body])
+
+    async def run():
+        async with _serving(respond) as (el, url):
+            s = el.session()
+            prepared = s.prepare('PUT', url + 'items', headers={'X-Test': 'yes'}, auth=('user', 'pass'))
+            responses = await asyncio.gather(prepared.send(), prepared.send('/1', data=b'one'),
+                                             prepared.send('/2?q=x', data='two'))
+            with pytest.raises(ValueError):
+                s.prepare('GET', url, headers_list=[1])
+        return [(r.request.url, r.text) for r in responses]
+
+    results = _await(run())
+    auth = 'Authorization: Basic dXNlcjpwYXNz'
+    assert [text.split('\n') for _, text in results] == [
+        ['PUT /items HTTP/1.1', auth, 'X-Test: yes', ''],
+        ['PUT /items/1 HTTP/1.1', auth, 'X-Test: yes', 'one'],
+        ['PUT /items/2?q=x HTTP/1.1', auth, 'X-Test: yes', 'two'],
+    ]
+    assert results[2][0].endswith('/items/2?q=x')
+
+
+def test_request_many():
+    def respond(line, headers, body):
+        return b' '.join(line.split(b' ')[:2] + [body])
+
+    async def run():
+        async with _serving(respond, backlog=1000) as (el, url):
+            s = el.session()
+            seen = []
+
+            async def callback(response):
+                seen.append(response.request.url)
+
+            s.set_response_callback(callback)
+            requests = [('GET', url + str(i)) if i % 2 else ('POST', url + str(i), b'body%d' % i) for i in range(500)]
+            texts = [r.text for r in await s.request_many(requests)]
+            assert seen == [url + str(i) for i in range(500)]
+            del seen[:]
+            # A bad request means none of them are sent
+            with pytest.raises(TypeError):
+                await s.request_many([('GET', url), ('GET', url, 1)])
+            with pytest.raises(ValueError):
+                await s.request_many([('GET', url)], headers_list=[1])
+            completed = el.get_stats()['completed_requests']
+            with pytest.raises(acurl.RequestError):
+                await s.request_many([('GET', 'http://127.0.0.1:1/'), ('GET', url)])
+            # The response which came back still went to the callback
+            assert seen == [url]
+        return texts, completed
+
+    texts, completed = _await(run())
+    assert texts == ['GET /%d ' % i if i % 2 else 'POST /%d body%d' % (i, i) for i in range(500)]
+    assert completed == 500
+
+
+def test_request_argument_errors():
+    el = acurl._acurl.EventLoop()
+    s = acurl._acurl.Session(el)
+    future = asyncio.get_event_loop().create_future()
+    required = (future, 'GET', 'http://localhost/', None, None, None, None, True, None)
+    with pytest.raises(TypeError, match="missing required argument 'url'"):
+        s.request(future, 'GET')
+    with pytest.raises(TypeError, match='at most 12 arguments'):
+        s.request(*required, None, None, False, None)
+    with pytest.raises(TypeError, match="unexpected keyword argument 'bogus'"):
+        s.request(*required, bogus=1)
+    with pytest.raises(TypeError, match="multiple values for argument 'url'"):
+        s.request(*required, url='http://localhost/')
+    with pytest.raises(TypeError, match="'method' must be str, not int"):
+        s.request(future, 1, *required[2:])
+    with pytest.raises(TypeError, match="'body_mode' must be str or None"):
+        # A keyword name which isn't interned is still matched
+        s.request(*required, **{''.join(['body', '_mode']): 1})
+    # The strings would be cut short at the NUL
+    with pytest.raises(ValueError, match='null character'):
+        s.request(future, 'GET', 'http://localhost/\x00.evil', *required[3:])
+    with pytest.raises(TypeError, match="missing required argument 'requests'"):
+        s.request_many(body_mode=None)
+    with pytest.raises(TypeError, match="'method' must be str, not int"):
+        s.request_many([(future, 1, 'http://localhost/', None, None, None, None, None)])
+    with pytest.raises(TypeError, match="'url' must be str, not bytes"):
+        s.request_many([(future, 'GET', b'http://localhost/', None, None, None, None, None)])
+    with pytest.raises(ValueError, match='null character'):
+        s.request_many([(future, 'GET', 'http://localhost/\x00.evil', None, None, None, None, None)])
+    with pytest.raises(ValueError, match='null character'):
+        s.request_many([(future, 'GET\x00', 'http://localhost/', None, None, None, None, None)])
+    prepared = s.prepare('GET', 'http://localhost/')
+    with pytest.raises(TypeError, match="missing required argument 'future'"):
+        prepared.send(url_suffix='/1')
+    with pytest.raises(ValueError, match='null character'):
+        prepared.send(future, '/1\x00')